@@ -1,11 +1,23 @@
 // filesys.c
 
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <time.h>
 
 // Variable Declarations 
 // Variables for Part 1:
@@ -53,77 +65,1083 @@ typedef struct __attribute__((packed)) directory_entry {
     uint32_t DIR_FileSize;
 } dentry_t;
 
-char current_path[1024] = "/";  // Initially at the root directory.
-char volume_label[12] = "";     // To store the volume label extracted from BootBlock.
-char img_path[50] = "";
-
-// Variables for Part 2:
-// Define a global variable to store the current cluster of the working directory
-uint32_t current_cluster = 0; // Root cluster at the start
-
 // Variables for Part 3:
 typedef struct{
     dentry_t entry;
     uint32_t file_pos;
-    char mode[3];
+    char mode[4];
+    struct readahead *ra; // Read-ahead state for readable handles, NULL if disabled
+    struct write_behind *wb; // Pending writes for writable handles, else NULL
+    uint32_t dir_cluster; // Where the entry lives, so the size can be written back
+    uint32_t entry_pos;
 }open_file_t;
 
 #define MAX_OPEN_FILES 32
-open_file_t open_files[MAX_OPEN_FILES];
-int open_files_count=0;
+
+// FAT32 entries only use the low 28 bits
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_EOC 0x0FFFFFFF       // End-of-chain marker written by this program
+#define FAT_EOC_MIN 0x0FFFFFF8   // Anything at or above this ends a chain
+
+// Volume layout, computed once from the boot sector at mount. Offsets are
+// 64-bit so images past 4 GB work. Sector and cluster sizes are validated
+// powers of two, so every cluster/byte translation is a shift or a mask.
+typedef struct {
+    uint32_t sector_size;       // Bytes per sector
+    uint32_t cluster_size;      // Bytes per cluster
+    uint32_t cluster_shift;     // log2(cluster_size)
+    uint32_t cluster_mask;      // cluster_size - 1
+    off_t fat_offset;           // Byte offset of the first FAT
+    off_t fat_size;             // Bytes in one FAT copy
+    uint32_t fat_count;         // Number of FAT copies
+    off_t data_offset;          // Byte offset of cluster 2
+    uint32_t total_clusters;    // Clusters in the data region
+    uint32_t cluster_limit;     // One past the last data cluster
+    uint64_t volume_size;       // Bytes covered by BPB_TotSec32
+} geometry_t;
+
+// Background reclaimer. Chains cut loose by rm, rmdir, rm -r and truncate
+// are queued here and freed by a worker thread in batches, so those
+// commands return without walking or freeing the chain themselves. A
+// queued chain is unreachable but still marked in use, so its clusters
+// cannot be handed out again until the reclaimer has really freed them.
+#define RECLAIM_BATCH_CLUSTERS 65536 // Most clusters freed per fs_lock hold
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    uint32_t *heads;       // First clusters of queued chains
+    uint32_t count;
+    uint32_t capacity;
+    bool busy;
+    bool started;
+    bool stopping;
+    pthread_t thread;
+} reclaimer_t;
+
+// FAT paging. The FAT is read in windows of FAT_WINDOW_ENTRIES entries as
+// they are needed and kept in at most --fat-cache bytes of slots. When
+// every slot is taken, a clock hand evicts the first window not used since
+// it last passed, writing its unflushed changes to every FAT copy first.
+// Each window's free-entry count is learned when it is first read (or from
+// the index), so allocation skips full windows without reading them again.
+#define FAT_WINDOW_ENTRIES (64 * 1024) // 256 KB per window
+#define FAT_NONE UINT32_MAX            // No slot, no window, or count not known yet
+
+typedef struct {
+    uint32_t *entries;
+    uint32_t window;       // Window held, or FAT_NONE
+    uint32_t dirty_first;  // Entries changed but not written out,
+    uint32_t dirty_end;    // [dirty_first, dirty_end) within the window
+    bool referenced;       // Used since the clock hand last passed
+} fat_slot_t;
+
+typedef struct {
+    pthread_rwlock_t lock; // Shared for lookups in resident windows; exclusive
+                           // to page a window in or change entries
+    fat_slot_t *slots;
+    uint32_t slot_count;
+    uint32_t hand;
+    uint32_t window_count;
+    uint32_t *slot_of;     // Slot holding each window, or FAT_NONE
+    uint32_t *free_count;  // Free entries in each window, or FAT_NONE
+} fat_pager_t;
+
+// Sidecar index (Part 15). A compact copy of what mounting and lookups need:
+// a free-cluster bitmap, the FAT as run-length extents, and every
+// directory's entries. While the index matches the image, FAT lookups are
+// answered from it and the FAT is not read until something changes it.
+#define INDEX_GROUP_CLUSTERS 4096 // FAT entries per checksummed group; extents never span two
+
+typedef struct {
+    uint32_t start;        // First cluster
+    uint32_t length;       // Clusters start .. start + length - 1 link to the next one
+    uint32_t next;         // FAT value of the last cluster
+} index_extent_t;
+
+typedef struct {
+    uint32_t first_cluster;
+    uint32_t crc;          // CRC32C of the directory's clusters
+    uint32_t first_entry;  // Its entries, less deleted ones, are entries[first_entry ..]
+    uint32_t entry_count;
+} index_dir_t;
+
+typedef struct __attribute__((packed)) {
+    dentry_t entry;
+    uint32_t pos;          // Byte position within the directory
+} index_entry_t;
+
+typedef struct mount_index {
+    char path[1024];           // The sidecar file
+    void *map;                 // The index file as loaded, or NULL if the
+    size_t map_size;           // arrays below were built in memory
+    uint32_t *group_crc;       // CRC32C of each group of FAT entries
+    uint32_t group_count;
+    uint64_t *bitmap;          // One bit per cluster, set if in use
+    uint32_t cluster_limit;
+    uint32_t free_count;
+    index_extent_t *extents;   // Sorted by start
+    uint32_t extent_count;
+    index_dir_t *dirs;         // Sorted by first_cluster
+    uint32_t dir_count;
+    index_entry_t *entries;
+    uint32_t entry_count;
+    bool dirs_current;         // Directory entries still match the image
+    bool changed;              // Needs saving at unmount
+    uint64_t *dirty_groups;    // Groups of FAT entries changed this session
+    uint64_t *dirty_clusters;  // Data clusters written this session; with
+                               // dirty_groups, what the unmount rebuild reads
+} mount_index_t;
+
+// Settings for a run, from the command line. Every mount carries its own
+// copy, so images mounted side by side (--each) never share them.
+typedef struct {
+    uint32_t readahead_max;    // --readahead, in bytes; 0 disables
+    uint64_t fat_cache_max;    // --fat-cache, in bytes
+    bool use_index;            // --index: keep a sidecar index next to the image
+    bool verify_index;         // --verify-index: check the whole FAT against the index at mount
+    long parallel_threads;     // Threads for each run_parallel() pass; 0 means one per core
+} mount_options_t;
+
+#define MOUNT_OPTIONS_DEFAULT { 128 * 1024, 16 * 1024 * 1024, false, false, 0 }
+
+// Everything that belongs to one mounted image. Every operation takes the
+// mount it works on, so one process can hold several images and work on
+// them from different threads.
+//
+// Locking:
+// fs_lock guards everything shared that lives on the image (the boot
+// sector, the FAT cache and directory clusters). Commands that only look at
+// the image take it shared so any number of threads can read files and
+// directories at once; commands that modify the image take it exclusive.
+// open_files_lock guards the open-file table and the handles in it.
+typedef struct mount {
+    mount_options_t options;
+    int img_fd;
+    bpb_t boot;
+    geometry_t geo;
+
+    // Windows of the first FAT paged in on demand. fat_set() keeps them
+    // and every on-disk FAT copy in sync. With a current sidecar index,
+    // reads go to the index until the first change.
+    fat_pager_t fat;
+    uint32_t fat_cache_entries;   // Entries in one FAT
+    uint32_t fat_generation;      // Bumped by every FAT change
+    mount_index_t *index;         // Sidecar index, NULL unless --index
+
+    char img_path[50];
+    char volume_label[12];        // From the boot sector
+    char current_path[1024];      // Working directory, "/" at the root
+    uint32_t current_cluster;     // First cluster of the working directory
+
+    open_file_t open_files[MAX_OPEN_FILES];
+    int open_files_count;
+
+    pthread_rwlock_t fs_lock;
+    pthread_mutex_t open_files_lock;
+    reclaimer_t reclaimer;
+    struct thread_pool *readahead_pool; // Background fetcher, NULL if read-ahead is off
+
+    bool copy_file_range_works;   // Cleared the first time the kernel refuses
+    FILE *out;                    // Command output: stdout, or a buffer in batch mode
+    bool command_failed;          // Set by command_error() during a command
+    FILE *record_file;            // --record trace, NULL unless recording
+    struct timespec session_start; // Trace times count from here
+} mount_t;
+
+// Defined further down, used before their parts
+void fat_pager_destroy(mount_t *m);
+void readahead_destroy(struct readahead *ra);
+void readahead_start(mount_t *m);
+void readahead_stop(mount_t *m);
+struct write_behind *write_behind_create(mount_t *m);
+void write_behind_destroy(struct write_behind *wb);
+bool write_behind_flush(mount_t *m, open_file_t *file);
+void flush_all_writes(mount_t *m);
+uint32_t entry_first_cluster(const dentry_t *entry);
+void set_entry_first_cluster(dentry_t *entry, uint32_t cluster);
+void compact_directory_if_sparse(mount_t *m, uint32_t dir_cluster);
+uint32_t *allocate_chain(mount_t *m, uint32_t count);
+uint8_t *read_directory_chain(mount_t *m, uint32_t dir_cluster, uint32_t *size);
+off_t directory_entry_offset(mount_t *m, uint32_t dir_cluster, uint32_t pos);
+bool directory_add_entry(mount_t *m, uint32_t dir_cluster, const dentry_t *new_entry);
+void index_open(mount_t *m, const char *image_path);
+void index_close(mount_t *m);
+int index_find_entry(mount_t *m, uint32_t dir_cluster, const char *name, dentry_t *found, uint32_t *entry_pos);
+void index_note_data(mount_t *m, off_t offset, size_t len);
+void command_error(mount_t *m, const char *format, ...);
+const index_dir_t *index_current_dir(mount_t *m, uint32_t dir_cluster);
+bool find_in_directory(mount_t *m, uint32_t dir_cluster, const char *name, dentry_t *found, uint32_t *entry_pos);
 
 // ============================================================================
 // ============================================================================
 
 // Part 1: Mount the Image File
 
-FILE *imgFile;
-bpb_t BootBlock;
+uint32_t log2_u32(uint32_t value) {
+    uint32_t shift = 0;
+    while (value > 1) {
+        value >>= 1;
+        shift++;
+    }
+    return shift;
+}
+
+// Fills m->geo from a boot sector that passed validate_boot_sector()
+void init_geometry(mount_t *m) {
+    const bpb_t *bpb = &m->boot;
+    m->geo.sector_size = bpb->BPB_BytsPerSec;
+    m->geo.cluster_size = (uint32_t)bpb->BPB_BytsPerSec * bpb->BPB_SecPerClus;
+    m->geo.cluster_shift = log2_u32(m->geo.cluster_size);
+    m->geo.cluster_mask = m->geo.cluster_size - 1;
+    m->geo.fat_offset = (off_t)bpb->BPB_RsvdSecCnt * m->geo.sector_size;
+    m->geo.fat_size = (off_t)bpb->BPB_FATSz32 * m->geo.sector_size;
+    m->geo.fat_count = bpb->BPB_NumFATs;
+    m->geo.data_offset = m->geo.fat_offset + m->geo.fat_count * m->geo.fat_size;
+
+    uint64_t data_sectors = bpb->BPB_TotSec32 - (uint64_t)(m->geo.data_offset / m->geo.sector_size);
+    m->geo.total_clusters = (uint32_t)(data_sectors / bpb->BPB_SecPerClus);
+    m->geo.cluster_limit = m->geo.total_clusters + 2;
+    m->geo.volume_size = (uint64_t)bpb->BPB_TotSec32 * m->geo.sector_size;
+}
+
+// Byte offset of the start of a data cluster within the image
+static inline off_t calculate_cluster_offset(mount_t *m, uint32_t cluster) {
+    return m->geo.data_offset + ((off_t)(cluster - 2) << m->geo.cluster_shift);
+}
 
-// Opening the FAT32 file
-void mount_fat32(const char *imgPath) {
-    imgFile = fopen(imgPath, "rb+");
-    if (imgFile == NULL) {
-        perror("Error opening file");
-        exit(EXIT_FAILURE);
+// Positional read from the image. pread() never touches a shared file
+// position, so any number of threads can call this at once.
+bool img_read(mount_t *m, void *buf, size_t len, off_t offset) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(m->img_fd, p, len, offset);
+        if (n <= 0) {
+            if (n < 0)
+                perror("Error reading image");
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
     }
-    fread(&BootBlock, sizeof(BootBlock), 1, imgFile);
+    return true;
+}
 
-    snprintf(volume_label, sizeof(volume_label), "%.11s", BootBlock.BS_VolLab);
-    snprintf(img_path, 50, "%s", imgPath);
-    current_cluster = BootBlock.BPB_RootClus; // For Part 2; assigns current_cluster the value of the root cluster
+// Positional write to the image
+bool img_write(mount_t *m, const void *buf, size_t len, off_t offset) {
+    index_note_data(m, offset, len);
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(m->img_fd, p, len, offset);
+        if (n <= 0) {
+            if (n < 0)
+                perror("Error writing image");
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
 }
 
-// Getting FAT32 File info
-void getInfo(){
-    uint32_t total_clusters = BootBlock.BPB_TotSec32 / BootBlock.BPB_SecPerClus; 
-    uint32_t image_size = BootBlock.BPB_TotSec32 * BootBlock.BPB_BytsPerSec;
-    uint32_t entries_in_fat = (BootBlock.BPB_FATSz32 * BootBlock.BPB_BytsPerSec) / 4;
+// One past the last cluster number that maps to the data region
+uint32_t data_cluster_limit(mount_t *m) {
+    return m->geo.cluster_limit < m->fat_cache_entries ? m->geo.cluster_limit : m->fat_cache_entries;
+}
+
+// True if the index has the cluster marked in use
+static inline bool index_in_use(const mount_index_t *ix, uint32_t cluster) {
+    return cluster < ix->cluster_limit && (ix->bitmap[cluster >> 6] >> (cluster & 63) & 1);
+}
+
+// The FAT entry for a cluster, answered from the index's extents
+uint32_t index_fat_get(const mount_index_t *ix, uint32_t cluster) {
+    if (!index_in_use(ix, cluster))
+        return 0;
+    uint32_t low = 0, high = ix->extent_count;
+    while (low < high) { // First extent starting after cluster
+        uint32_t mid = low + (high - low) / 2;
+        if (ix->extents[mid].start <= cluster)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    if (low == 0)
+        return 0;
+    const index_extent_t *extent = &ix->extents[low - 1];
+    if (cluster - extent->start + 1 < extent->length)
+        return cluster + 1;
+    return cluster - extent->start + 1 == extent->length ? extent->next : 0;
+}
+
+// Keeps the index's bitmap and free count in step with a FAT change
+void index_note_fat(mount_index_t *ix, uint32_t cluster, uint32_t value) {
+    ix->changed = true;
+    if (cluster >= ix->cluster_limit)
+        return;
+    if (ix->dirty_groups != NULL)
+        ix->dirty_groups[cluster / INDEX_GROUP_CLUSTERS >> 6] |= (uint64_t)1 << (cluster / INDEX_GROUP_CLUSTERS & 63);
+    bool was_used = index_in_use(ix, cluster);
+    bool used = (value & FAT_ENTRY_MASK) != 0;
+    if (was_used == used)
+        return;
+    ix->bitmap[cluster >> 6] ^= (uint64_t)1 << (cluster & 63);
+    if (cluster >= 2)
+        ix->free_count += used ? -1 : 1;
+}
+
+// Records the data clusters a write to the image touches, so the rebuild at
+// unmount knows which directories to read again
+void index_note_data(mount_t *m, off_t offset, size_t len) {
+    mount_index_t *ix = m->index;
+    if (ix == NULL || ix->dirty_clusters == NULL || len == 0 || offset < (off_t)m->geo.data_offset)
+        return;
+    uint64_t first = ((uint64_t)(offset - m->geo.data_offset) >> m->geo.cluster_shift) + 2;
+    uint64_t last = ((uint64_t)(offset - m->geo.data_offset + len - 1) >> m->geo.cluster_shift) + 2;
+    for (uint64_t c = first; c <= last && c < ix->cluster_limit; c++)
+        __atomic_fetch_or(&ix->dirty_clusters[c >> 6], (uint64_t)1 << (c & 63), __ATOMIC_RELAXED);
+}
+
+uint32_t fat_window_size(mount_t *m, uint32_t window) {
+    uint32_t first = window * FAT_WINDOW_ENTRIES;
+    return m->fat_cache_entries - first < FAT_WINDOW_ENTRIES ? m->fat_cache_entries - first : FAT_WINDOW_ENTRIES;
+}
+
+// Writes entries [first, end) of a slot's window to every FAT copy
+bool fat_write_slot(mount_t *m, fat_slot_t *slot, uint32_t first, uint32_t end) {
+    off_t offset = ((off_t)slot->window * FAT_WINDOW_ENTRIES + first) * sizeof(uint32_t);
+    bool ok = true;
+    for (uint32_t i = 0; i < m->geo.fat_count; i++)
+        ok = img_write(m, &slot->entries[first], (end - first) * sizeof(uint32_t),
+                       m->geo.fat_offset + i * m->geo.fat_size + offset) && ok;
+    return ok;
+}
+
+// Writes out a slot's unflushed changes, if any
+void fat_clean_slot(mount_t *m, fat_slot_t *slot) {
+    if (slot->dirty_first < slot->dirty_end)
+        fat_write_slot(m, slot, slot->dirty_first, slot->dirty_end);
+    slot->dirty_first = FAT_WINDOW_ENTRIES;
+    slot->dirty_end = 0;
+}
+
+// Free entries among the data clusters of a window's entries
+uint32_t fat_count_free(mount_t *m, uint32_t window, const uint32_t *entries) {
+    uint32_t first = window * FAT_WINDOW_ENTRIES, size = fat_window_size(m, window);
+    uint32_t limit = data_cluster_limit(m), free_count = 0;
+    for (uint32_t c = first < 2 ? 2 : first; c < first + size && c < limit; c++)
+        free_count += (entries[c - first] & FAT_ENTRY_MASK) == 0;
+    return free_count;
+}
+
+// Returns the slot holding a window, reading it in (and evicting another
+// window) if needed. NULL if it cannot be read. Caller holds fat.lock
+// exclusively.
+fat_slot_t *fat_window(mount_t *m, uint32_t window) {
+    fat_pager_t *fat = &m->fat;
+    if (fat->slot_of[window] != FAT_NONE) {
+        fat_slot_t *slot = &fat->slots[fat->slot_of[window]];
+        slot->referenced = true;
+        return slot;
+    }
+
+    fat_slot_t *slot;
+    while (1) {
+        slot = &fat->slots[fat->hand];
+        fat->hand = (fat->hand + 1) % fat->slot_count;
+        if (slot->window == FAT_NONE || !slot->referenced)
+            break;
+        slot->referenced = false;
+    }
+    if (slot->window != FAT_NONE) {
+        fat_clean_slot(m, slot);
+        fat->slot_of[slot->window] = FAT_NONE;
+        slot->window = FAT_NONE;
+    }
+    if (slot->entries == NULL && (slot->entries = malloc(FAT_WINDOW_ENTRIES * sizeof(uint32_t))) == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    uint32_t first = window * FAT_WINDOW_ENTRIES, size = fat_window_size(m, window);
+    if (!img_read(m, slot->entries, size * sizeof(uint32_t), m->geo.fat_offset + (off_t)first * sizeof(uint32_t)))
+        return NULL;
+
+    fat->free_count[window] = fat_count_free(m, window, slot->entries);
+
+    slot->window = window;
+    slot->dirty_first = FAT_WINDOW_ENTRIES;
+    slot->dirty_end = 0;
+    slot->referenced = true;
+    fat->slot_of[window] = slot - fat->slots;
+    return slot;
+}
+
+// Sets up paging for a freshly mounted image and reads the first window,
+// so an unreadable FAT fails the mount
+bool fat_pager_init(mount_t *m) {
+    fat_pager_t *fat = &m->fat;
+    fat->window_count = (m->fat_cache_entries + FAT_WINDOW_ENTRIES - 1) / FAT_WINDOW_ENTRIES;
+    uint64_t slots = m->options.fat_cache_max / (FAT_WINDOW_ENTRIES * sizeof(uint32_t));
+    fat->slot_count = slots < fat->window_count ? (uint32_t)slots : fat->window_count;
+    if (fat->slot_count == 0)
+        fat->slot_count = 1;
+    fat->hand = 0;
+    fat->slots = calloc(fat->slot_count, sizeof(fat_slot_t));
+    fat->slot_of = malloc(fat->window_count * sizeof(uint32_t));
+    fat->free_count = malloc(fat->window_count * sizeof(uint32_t));
+    pthread_rwlock_init(&fat->lock, NULL);
+    if (fat->slots == NULL || fat->slot_of == NULL || fat->free_count == NULL) {
+        perror("Memory allocation failed");
+        fat_pager_destroy(m);
+        return false;
+    }
+    for (uint32_t i = 0; i < fat->slot_count; i++)
+        fat->slots[i].window = FAT_NONE;
+    for (uint32_t w = 0; w < fat->window_count; w++)
+        fat->slot_of[w] = fat->free_count[w] = FAT_NONE;
+    if (fat->window_count == 0 || fat_window(m, 0) == NULL) {
+        fat_pager_destroy(m);
+        return false;
+    }
+    return true;
+}
+
+// Writes back anything unflushed and frees the windows
+void fat_pager_destroy(mount_t *m) {
+    fat_pager_t *fat = &m->fat;
+    if (fat->slots == NULL && fat->slot_of == NULL && fat->free_count == NULL)
+        return;
+    for (uint32_t i = 0; fat->slots != NULL && i < fat->slot_count; i++) {
+        if (fat->slots[i].window != FAT_NONE)
+            fat_clean_slot(m, &fat->slots[i]);
+        free(fat->slots[i].entries);
+    }
+    free(fat->slots);
+    free(fat->slot_of);
+    free(fat->free_count);
+    fat->slots = NULL;
+    fat->slot_of = NULL;
+    fat->free_count = NULL;
+    pthread_rwlock_destroy(&fat->lock);
+}
+
+// Copies count raw FAT entries (reserved bits included) starting at first
+// Resident windows are copied under the shared lock, as in fat_get(); the
+// first window that has to be paged in switches to the exclusive lock.
+bool fat_read_entries(mount_t *m, uint32_t first, uint32_t count, uint32_t *out) {
+    bool ok = true, exclusive = false;
+    pthread_rwlock_rdlock(&m->fat.lock);
+    while (ok && count > 0) {
+        uint32_t window = first / FAT_WINDOW_ENTRIES, at = first % FAT_WINDOW_ENTRIES;
+        uint32_t chunk = fat_window_size(m, window) - at;
+        if (chunk > count)
+            chunk = count;
+        fat_slot_t *slot;
+        if (m->fat.slot_of[window] != FAT_NONE) {
+            slot = &m->fat.slots[m->fat.slot_of[window]];
+            __atomic_store_n(&slot->referenced, true, __ATOMIC_RELAXED);
+        } else {
+            if (!exclusive) {
+                pthread_rwlock_unlock(&m->fat.lock);
+                pthread_rwlock_wrlock(&m->fat.lock);
+                exclusive = true;
+            }
+            slot = fat_window(m, window);
+        }
+        if (slot != NULL)
+            memcpy(out, &slot->entries[at], chunk * sizeof(uint32_t));
+        ok = slot != NULL;
+        out += chunk;
+        first += chunk;
+        count -= chunk;
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+    return ok;
+}
+
+// Free data clusters in a window. Once known, fat_put() keeps the count in
+// step, so it is read under the shared lock. An unknown count is taken
+// from the image without paging the window in, so counting the whole FAT
+// (info) leaves the cache alone; the shared lock keeps fat_put() from
+// changing the window meanwhile.
+uint32_t fat_window_free(mount_t *m, uint32_t window) {
+    pthread_rwlock_rdlock(&m->fat.lock);
+    uint32_t free_count = __atomic_load_n(&m->fat.free_count[window], __ATOMIC_RELAXED);
+    if (free_count == FAT_NONE) {
+        uint32_t *entries = malloc(FAT_WINDOW_ENTRIES * sizeof(uint32_t));
+        uint32_t size = fat_window_size(m, window);
+        if (entries != NULL && img_read(m, entries, size * sizeof(uint32_t),
+                                        m->geo.fat_offset + (off_t)window * FAT_WINDOW_ENTRIES * sizeof(uint32_t))) {
+            free_count = fat_count_free(m, window, entries);
+            __atomic_store_n(&m->fat.free_count[window], free_count, __ATOMIC_RELAXED);
+        }
+        free(entries);
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+    return free_count == FAT_NONE ? 0 : free_count;
+}
+
+// Returns the FAT entry for the given cluster (0 for out-of-range clusters)
+uint32_t fat_get(mount_t *m, uint32_t cluster) {
+    if (cluster >= m->fat_cache_entries)
+        return 0;
+    if (m->index != NULL && !m->index->changed)
+        return index_fat_get(m->index, cluster);
+    uint32_t window = cluster / FAT_WINDOW_ENTRIES, at = cluster % FAT_WINDOW_ENTRIES;
+
+    // Resident window: many readers (the sum/dupes/grep workers) at once
+    pthread_rwlock_rdlock(&m->fat.lock);
+    if (m->fat.slot_of[window] != FAT_NONE) {
+        fat_slot_t *slot = &m->fat.slots[m->fat.slot_of[window]];
+        __atomic_store_n(&slot->referenced, true, __ATOMIC_RELAXED);
+        uint32_t value = slot->entries[at] & FAT_ENTRY_MASK;
+        pthread_rwlock_unlock(&m->fat.lock);
+        return value;
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+
+    pthread_rwlock_wrlock(&m->fat.lock);
+    fat_slot_t *slot = fat_window(m, window);
+    uint32_t value = slot != NULL ? slot->entries[at] & FAT_ENTRY_MASK : 0;
+    pthread_rwlock_unlock(&m->fat.lock);
+    return value;
+}
+
+// Sets the FAT entry for the given cluster in its window only. Callers
+// changing many entries batch them with fat_put() and write them out with
+// one fat_flush() per contiguous range.
+void fat_put(mount_t *m, uint32_t cluster, uint32_t value) {
+    if (cluster >= m->fat_cache_entries)
+        return;
+    pthread_rwlock_wrlock(&m->fat.lock);
+    uint32_t window = cluster / FAT_WINDOW_ENTRIES, at = cluster % FAT_WINDOW_ENTRIES;
+    fat_slot_t *slot = fat_window(m, window);
+    if (slot != NULL) {
+        if (m->index != NULL)
+            index_note_fat(m->index, cluster, value);
+        bool was_free = (slot->entries[at] & FAT_ENTRY_MASK) == 0;
+        bool now_free = (value & FAT_ENTRY_MASK) == 0;
+        if (was_free != now_free && cluster >= 2 && cluster < data_cluster_limit(m))
+            m->fat.free_count[window] += now_free ? 1 : -1;
+        m->fat_generation++;
+        // Preserve the reserved high 4 bits as the spec requires
+        slot->entries[at] = (slot->entries[at] & ~FAT_ENTRY_MASK) | (value & FAT_ENTRY_MASK);
+        if (at < slot->dirty_first)
+            slot->dirty_first = at;
+        if (at + 1 > slot->dirty_end)
+            slot->dirty_end = at + 1;
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+}
+
+// Writes count FAT entries starting at first to every FAT copy. Windows
+// evicted since their changes were made have been written already.
+void fat_flush(mount_t *m, uint32_t first, uint32_t count) {
+    if (first >= m->fat_cache_entries)
+        return;
+    if (count > m->fat_cache_entries - first)
+        count = m->fat_cache_entries - first;
+
+    pthread_rwlock_wrlock(&m->fat.lock);
+    while (count > 0) {
+        uint32_t window = first / FAT_WINDOW_ENTRIES, at = first % FAT_WINDOW_ENTRIES;
+        uint32_t chunk = fat_window_size(m, window) - at;
+        if (chunk > count)
+            chunk = count;
+        if (m->fat.slot_of[window] != FAT_NONE) {
+            fat_slot_t *slot = &m->fat.slots[m->fat.slot_of[window]];
+            fat_write_slot(m, slot, at, at + chunk);
+            if (at <= slot->dirty_first && at + chunk >= slot->dirty_end) {
+                slot->dirty_first = FAT_WINDOW_ENTRIES;
+                slot->dirty_end = 0;
+            }
+        }
+        first += chunk;
+        count -= chunk;
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+}
+
+// Writes out every window's unflushed changes
+void fat_sync(mount_t *m) {
+    if (m->fat.slots == NULL)
+        return;
+    pthread_rwlock_wrlock(&m->fat.lock);
+    for (uint32_t i = 0; i < m->fat.slot_count; i++) {
+        if (m->fat.slots[i].window != FAT_NONE)
+            fat_clean_slot(m, &m->fat.slots[i]);
+    }
+    pthread_rwlock_unlock(&m->fat.lock);
+}
+
+// Sets the FAT entry for the given cluster in the cache and in every FAT copy
+void fat_set(mount_t *m, uint32_t cluster, uint32_t value) {
+    fat_put(m, cluster, value);
+    fat_flush(m, cluster, 1);
+}
+
+// True if the FAT entry value links to another data cluster
+bool is_chain_cluster(uint32_t cluster) {
+    return cluster >= 2 && cluster < FAT_EOC_MIN;
+}
+
+// Returns the clusters of the chain starting at first_cluster, in order.
+// Caller frees. Returns NULL with *count 0 for an empty chain.
+uint32_t *get_cluster_chain(mount_t *m, uint32_t first_cluster, uint32_t *count) {
+    uint32_t capacity = 16;
+    uint32_t *chain = NULL;
+    *count = 0;
+
+    for (uint32_t c = first_cluster; is_chain_cluster(c) && *count < m->fat_cache_entries; c = fat_get(m, c)) {
+        if (chain == NULL || *count == capacity) {
+            if (chain != NULL)
+                capacity *= 2;
+            uint32_t *grown = realloc(chain, capacity * sizeof(uint32_t));
+            if (grown == NULL) {
+                perror("Memory allocation failed");
+                free(chain);
+                *count = 0;
+                return NULL;
+            }
+            chain = grown;
+        }
+        chain[(*count)++] = c;
+    }
+    return chain;
+}
+
+int compare_clusters(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Marks every listed cluster free. The list is sorted in place so the
+// changes land in as few FAT sectors as possible; each run of adjacent
+// dirty sectors then goes out as one write per FAT copy, instead of one
+// small write per cluster.
+void fat_free_clusters(mount_t *m, uint32_t *clusters, uint32_t count) {
+    if (count == 0)
+        return;
+    qsort(clusters, count, sizeof(uint32_t), compare_clusters);
+    for (uint32_t i = 0; i < count; i++)
+        fat_put(m, clusters[i], 0);
+
+    uint32_t per_sector = m->geo.sector_size / sizeof(uint32_t);
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t first_sector = clusters[i] / per_sector;
+        uint32_t last_sector = first_sector;
+        while (i < count && clusters[i] / per_sector <= last_sector + 1) {
+            last_sector = clusters[i] / per_sector;
+            i++;
+        }
+        fat_flush(m, first_sector * per_sector, (last_sector - first_sector + 1) * per_sector);
+    }
+}
+
+
+// Appends chain heads to the queue. Caller holds reclaimer.lock.
+bool reclaim_queue_locked(mount_t *m, const uint32_t *heads, uint32_t count) {
+    if (m->reclaimer.count + count > m->reclaimer.capacity) {
+        uint32_t capacity = m->reclaimer.capacity ? m->reclaimer.capacity : 64;
+        while (capacity < m->reclaimer.count + count)
+            capacity *= 2;
+        uint32_t *grown = realloc(m->reclaimer.heads, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+            return false;
+        m->reclaimer.heads = grown;
+        m->reclaimer.capacity = capacity;
+    }
+    memcpy(m->reclaimer.heads + m->reclaimer.count, heads, count * sizeof(uint32_t));
+    m->reclaimer.count += count;
+    return true;
+}
+
+// Frees up to RECLAIM_BATCH_CLUSTERS clusters from the given chains in one
+// sorted batch. Chains that do not fit are cut and their remainder's first
+// cluster returned through leftovers. Caller holds fs_lock exclusively.
+uint32_t reclaim_batch(mount_t *m, const uint32_t *heads, uint32_t count, uint32_t *leftovers) {
+    uint32_t *batch = malloc(RECLAIM_BATCH_CLUSTERS * sizeof(uint32_t));
+    uint32_t left = 0;
+    if (batch == NULL) {
+        memcpy(leftovers, heads, count * sizeof(uint32_t));
+        return count;
+    }
+    uint32_t n = 0;
+    for (uint32_t h = 0; h < count; h++) {
+        uint32_t c = heads[h];
+        while (is_chain_cluster(c) && n < RECLAIM_BATCH_CLUSTERS) {
+            batch[n++] = c;
+            c = fat_get(m, c);
+        }
+        if (is_chain_cluster(c))
+            leftovers[left++] = c;
+    }
+    fat_free_clusters(m, batch, n);
+    free(batch);
+    return left;
+}
+
+void *reclaimer_main(void *arg) {
+    mount_t *m = arg;
+    pthread_mutex_lock(&m->reclaimer.lock);
+    while (1) {
+        while (m->reclaimer.count == 0 && !m->reclaimer.stopping)
+            pthread_cond_wait(&m->reclaimer.work, &m->reclaimer.lock);
+        if (m->reclaimer.count == 0)
+            break; // Stopping with nothing left to free
+
+        uint32_t *heads = m->reclaimer.heads;
+        uint32_t count = m->reclaimer.count;
+        m->reclaimer.heads = NULL;
+        m->reclaimer.count = m->reclaimer.capacity = 0;
+        m->reclaimer.busy = true;
+        pthread_mutex_unlock(&m->reclaimer.lock);
+
+        uint32_t *leftovers = malloc(count * sizeof(uint32_t));
+        uint32_t left = 0;
+        pthread_rwlock_wrlock(&m->fs_lock);
+        if (leftovers != NULL)
+            left = reclaim_batch(m, heads, count, leftovers);
+        pthread_rwlock_unlock(&m->fs_lock);
+
+        pthread_mutex_lock(&m->reclaimer.lock);
+        if (leftovers == NULL)
+            reclaim_queue_locked(m, heads, count); // Try again later
+        else if (left > 0)
+            reclaim_queue_locked(m, leftovers, left);
+        free(leftovers);
+        free(heads);
+        m->reclaimer.busy = false;
+        if (m->reclaimer.count == 0)
+            pthread_cond_broadcast(&m->reclaimer.idle);
+    }
+    m->reclaimer.busy = false;
+    pthread_cond_broadcast(&m->reclaimer.idle);
+    pthread_mutex_unlock(&m->reclaimer.lock);
+    return NULL;
+}
+
+// Hands chains to the reclaimer. Frees them right away, in the caller's
+// fs_lock, if the worker thread cannot be started.
+void reclaim_chains(mount_t *m, const uint32_t *heads, uint32_t count) {
+    pthread_mutex_lock(&m->reclaimer.lock);
+    if (!m->reclaimer.started && !m->reclaimer.stopping)
+        m->reclaimer.started = pthread_create(&m->reclaimer.thread, NULL, reclaimer_main, m) == 0;
+    bool queued = m->reclaimer.started && !m->reclaimer.stopping && reclaim_queue_locked(m, heads, count);
+    if (queued)
+        pthread_cond_signal(&m->reclaimer.work);
+    pthread_mutex_unlock(&m->reclaimer.lock);
+
+    if (!queued) {
+        for (uint32_t h = 0; h < count; h++) {
+            uint32_t c;
+            uint32_t *chain = get_cluster_chain(m, heads[h], &c);
+            fat_free_clusters(m, chain, c);
+            free(chain);
+        }
+    }
+}
+
+void reclaim_chain(mount_t *m, uint32_t first_cluster) {
+    if (is_chain_cluster(first_cluster))
+        reclaim_chains(m, &first_cluster, 1);
+}
+
+// Waits until everything queued so far has been freed. Must not be called
+// with fs_lock held.
+void reclaim_drain(mount_t *m) {
+    pthread_mutex_lock(&m->reclaimer.lock);
+    while (m->reclaimer.count > 0 || m->reclaimer.busy)
+        pthread_cond_wait(&m->reclaimer.idle, &m->reclaimer.lock);
+    pthread_mutex_unlock(&m->reclaimer.lock);
+}
+
+// Frees whatever is still queued and stops the worker thread
+void reclaim_stop(mount_t *m) {
+    pthread_mutex_lock(&m->reclaimer.lock);
+    bool started = m->reclaimer.started;
+    m->reclaimer.stopping = true;
+    pthread_cond_signal(&m->reclaimer.work);
+    pthread_mutex_unlock(&m->reclaimer.lock);
+    if (started)
+        pthread_join(m->reclaimer.thread, NULL);
+    m->reclaimer.started = false;
+}
+
+bool is_power_of_two(uint32_t value) {
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Checks that a boot sector describes a FAT32 volume this program can use.
+// Returns NULL if it does, otherwise the reason it does not.
+const char *validate_boot_sector(const uint8_t *sector, off_t image_size) {
+    const bpb_t *bpb = (const bpb_t *)sector;
+    if (sector[510] != 0x55 || sector[511] != 0xAA)
+        return "missing boot sector signature";
+    if (bpb->BPB_BytsPerSec < 512 || bpb->BPB_BytsPerSec > 4096 || !is_power_of_two(bpb->BPB_BytsPerSec))
+        return "bytes per sector must be 512, 1024, 2048 or 4096";
+    if (!is_power_of_two(bpb->BPB_SecPerClus))
+        return "sectors per cluster must be a power of two";
+    if ((uint32_t)bpb->BPB_BytsPerSec * bpb->BPB_SecPerClus > 32 * 1024)
+        return "clusters larger than 32K are not supported";
+    if (bpb->BPB_RsvdSecCnt == 0 || bpb->BPB_NumFATs == 0)
+        return "no reserved sectors or no FATs";
+    if (bpb->BPB_FATSz16 != 0 || bpb->BPB_FATSz32 == 0 || bpb->BPB_RootEntCnt != 0)
+        return "not a FAT32 volume";
+    if (bpb->BPB_TotSec32 == 0)
+        return "total sector count is zero";
+
+    uint64_t first_data_sector = bpb->BPB_RsvdSecCnt + (uint64_t)bpb->BPB_NumFATs * bpb->BPB_FATSz32;
+    if (first_data_sector >= bpb->BPB_TotSec32)
+        return "FATs extend past the end of the volume";
+    uint64_t clusters = (bpb->BPB_TotSec32 - first_data_sector) / bpb->BPB_SecPerClus;
+    if ((uint64_t)bpb->BPB_FATSz32 * bpb->BPB_BytsPerSec / 4 < clusters + 2)
+        return "FAT is too small for the data region";
+    if (bpb->BPB_RootClus < 2 || bpb->BPB_RootClus >= clusters + 2)
+        return "root cluster is outside the data region";
+    if (image_size < (off_t)(first_data_sector * bpb->BPB_BytsPerSec))
+        return "image is shorter than its FATs";
+    return NULL;
+}
+
+// Sets up an unmounted context; mount_fat32() fills in the rest
+void mount_init(mount_t *m, const mount_options_t *options) {
+    memset(m, 0, sizeof(*m));
+    m->options = *options;
+    m->img_fd = -1;
+    strcpy(m->current_path, "/");
+    pthread_rwlock_init(&m->fs_lock, NULL);
+    pthread_mutex_init(&m->open_files_lock, NULL);
+    pthread_mutex_init(&m->reclaimer.lock, NULL);
+    pthread_cond_init(&m->reclaimer.work, NULL);
+    pthread_cond_init(&m->reclaimer.idle, NULL);
+    m->copy_file_range_works = true;
+    m->out = stdout;
+}
+
+// Releases what mount_init() set up. unmount_fat32() ends with this; call
+// it directly when mount_fat32() fails.
+void mount_destroy(mount_t *m) {
+    pthread_rwlock_destroy(&m->fs_lock);
+    pthread_mutex_destroy(&m->open_files_lock);
+    pthread_mutex_destroy(&m->reclaimer.lock);
+    pthread_cond_destroy(&m->reclaimer.work);
+    pthread_cond_destroy(&m->reclaimer.idle);
+}
+
+// Opening the FAT32 file. Returns false, with the reason printed, if the
+// image cannot be used.
+bool mount_fat32(mount_t *m, const char *imgPath) {
+    m->img_fd = open(imgPath, O_RDWR);
+    if (m->img_fd < 0) {
+        command_error(m, "Error: could not open '%s': %s.\n", imgPath, strerror(errno));
+        return false;
+    }
+
+    uint8_t sector[512];
+    struct stat st;
+    const char *problem = NULL;
+    if (fstat(m->img_fd, &st) != 0 || !img_read(m, sector, sizeof(sector), 0)) {
+        command_error(m, "Error: could not read the boot sector of '%s'.\n", imgPath);
+    } else if ((problem = validate_boot_sector(sector, st.st_size)) != NULL) {
+        command_error(m, "Error: '%s' is not a usable FAT32 image: %s.\n", imgPath, problem);
+    } else {
+        memcpy(&m->boot, sector, sizeof(m->boot));
+        init_geometry(m);
+        m->fat_cache_entries = (uint32_t)(m->geo.fat_size / sizeof(uint32_t));
+        if (fat_pager_init(m)) {
+            if (m->options.use_index)
+                index_open(m, imgPath);
+            snprintf(m->volume_label, sizeof(m->volume_label), "%.11s", m->boot.BS_VolLab);
+            snprintf(m->img_path, 50, "%s", imgPath);
+            m->current_cluster = m->boot.BPB_RootClus; // For Part 2; assigns current_cluster the value of the root cluster
+            readahead_start(m);
+            return true;
+        }
+        command_error(m, "Error: could not read FAT32 metadata from '%s'.\n", imgPath);
+    }
+    close(m->img_fd);
+    m->img_fd = -1;
+    return false;
+}
+
+uint32_t count_free_clusters(mount_t *m) {
+    if (m->index != NULL)
+        return m->index->free_count;
+    uint32_t free_count = 0;
+    for (uint32_t w = 0; w < m->fat.window_count; w++)
+        free_count += fat_window_free(m, w);
+    return free_count;
+}
 
-    printf("Bytes per sector: %u\n", BootBlock.BPB_BytsPerSec);
-    printf("Sectors per cluster: %u\n", BootBlock.BPB_SecPerClus);
-    printf("Root cluster: %u\n", BootBlock.BPB_RootClus);
-    printf("Total # of clusters in data region: %u\n", total_clusters);
-    printf("Number of entries in FAT: %u\n", entries_in_fat);
-    printf("Size of image (bytes): %u\n", image_size);
+// Getting FAT32 File info
+void getInfo(mount_t *m){
+    uint32_t entries_in_fat = (uint32_t)(m->geo.fat_size / 4);
+
+    fprintf(m->out, "Bytes per sector: %u\n", m->boot.BPB_BytsPerSec);
+    fprintf(m->out, "Sectors per cluster: %u\n", m->boot.BPB_SecPerClus);
+    fprintf(m->out, "Root cluster: %u\n", m->boot.BPB_RootClus);
+    fprintf(m->out, "Total # of clusters in data region: %u\n", m->geo.total_clusters);
+    fprintf(m->out, "Number of entries in FAT: %u\n", entries_in_fat);
+    fprintf(m->out, "Size of image (bytes): %" PRIu64 "\n", m->geo.volume_size);
+    fprintf(m->out, "Free clusters: %u\n", count_free_clusters(m));
 }
 
 // Diplays terminal as [NAME_OF_IMAGE]/[PATH_IN_IMAGE]/>
-void display_prompt() {
-    printf("%s%s> ", img_path, current_path);
+void display_prompt(mount_t *m) {
+    fprintf(m->out, "%s%s> ", m->img_path, m->current_path);
 }
 
-// Exiting the program
-void exitProgram() {
+// Finishes pending work, closes open handles and releases the image
+void unmount_fat32(mount_t *m) {
+    pthread_rwlock_wrlock(&m->fs_lock);
+    flush_all_writes(m);
+    pthread_rwlock_unlock(&m->fs_lock);
+
+    // finish freeing removed clusters before the image goes away, and get
+    // the FAT onto the image before the index is stamped with its mtime
+    reclaim_stop(m);
+    fat_sync(m);
+    index_close(m);
+
+    pthread_mutex_lock(&m->open_files_lock);
+    for (int i = 0; i < m->open_files_count; i++) {
+        readahead_destroy(m->open_files[i].ra);
+        write_behind_destroy(m->open_files[i].wb);
+    }
+    m->open_files_count = 0;
+    pthread_mutex_unlock(&m->open_files_lock);
+    // fetches still queued for the closed handles run out here
+    readahead_stop(m);
+
     // close the image file
-    if (imgFile != NULL) {
-        fclose(imgFile);
-        imgFile = NULL;
+    fat_pager_destroy(m);
+    if (m->img_fd >= 0) {
+        close(m->img_fd);
+        m->img_fd = -1;
     }
-    // free any other resources here ...
+    free(m->reclaimer.heads);
+    m->reclaimer.heads = NULL;
+    mount_destroy(m);
+}
+
+// Exiting the program
+void exitProgram(mount_t *m) {
+    unmount_fat32(m);
     exit(0);
 }
 
+// Thread pool for background and parallel work. Jobs run in submission
+// order on whichever worker is free; pool_wait() blocks until every job
+// submitted so far has finished.
+typedef struct pool_job {
+    void (*fn)(void *);
+    void *arg;
+    struct pool_job *next;
+} pool_job_t;
+
+typedef struct thread_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    pool_job_t *head, *tail;
+    int pending;      // Jobs queued or running
+    bool stopping;
+    int thread_count;
+    pthread_t *threads;
+} thread_pool_t;
+
+void *pool_worker(void *arg) {
+    thread_pool_t *pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->head == NULL)
+            break; // Stopping and nothing left to do
+        pool_job_t *job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        job->fn(job->arg);
+        free(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->work_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+bool pool_init(thread_pool_t *pool, int threads) {
+    memset(pool, 0, sizeof(thread_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+    pool->threads = malloc(threads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_worker, pool) != 0)
+            break;
+        pool->thread_count++;
+    }
+    return pool->thread_count > 0;
+}
+
+// Queues fn(arg). Runs it on the calling thread if the pool has no workers.
+void pool_submit(thread_pool_t *pool, void (*fn)(void *), void *arg) {
+    pool_job_t *job = pool->thread_count > 0 ? malloc(sizeof(pool_job_t)) : NULL;
+    if (job == NULL) {
+        fn(arg);
+        return;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(thread_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    pool->threads = NULL;
+    pool->thread_count = 0;
+}
+
 // ============================================================================
 // ============================================================================
 
@@ -135,20 +1153,10 @@ typedef struct directory_node {
     struct directory_node* next;
 } dir_node_t;
 
-// Reads the content of the current directory cluster into a buffer
-uint8_t* read_current_directory_cluster(uint32_t* cluster_size) {
-    *cluster_size = BootBlock.BPB_BytsPerSec * BootBlock.BPB_SecPerClus;
-    uint8_t *buffer = malloc(*cluster_size);
-    if (!buffer) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
-
-    uint32_t first_data_sector = BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32);
-    uint32_t first_sector_of_cluster = ((current_cluster - 2) * BootBlock.BPB_SecPerClus) + first_data_sector;
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fread(buffer, *cluster_size, 1, imgFile);
-    return buffer;
+// Reads every cluster of the current directory into a buffer; directories
+// grow past one cluster once directory_add_entry() fills them
+uint8_t* read_current_directory_cluster(mount_t *m, uint32_t* cluster_size) {
+    return read_directory_chain(m, m->current_cluster, cluster_size);
 }
 
 // Formats directory names from FAT32 to a more readable format
@@ -165,75 +1173,61 @@ void format_dirname(const char *DIR_Name, char *formatted_name) {
 }
 
 // Changing the directory
-void change_directory(const char* dirname) {
-    uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
-    if (!buffer) {
-        return; // Memory allocation failed, error handled in the helper function
-    }
-
-    int found = 0;
-    dentry_t *entry = NULL;
-    for (int i = 0; i < (int)cluster_size; i += sizeof(dentry_t)) {
-        entry = (dentry_t *)(buffer + i);
-        if (entry->DIR_Name[0] == 0x00) // No more entries
-            break;
-        if ((unsigned char) entry->DIR_Name[0] ==  0xE5) // Skipped deleted entry
-            continue;
-        if (entry->DIR_Attr & 0x10) { // Directory attribute
-
-            char formatted_name[12];
-            format_dirname(entry->DIR_Name, formatted_name);
-
-            /* TESTING FLAG: 
-            printf("Comparing: '%s' with '%s'\n", formatted_name, dirname);
-            */
-
-            // Compare ignoring case and trailing spaces
-            if (strcasecmp(formatted_name, dirname) == 0) {
-                found = 1;
-                break;
-            }
-        }
-    }
+void change_directory(mount_t *m, const char* dirname) {
+    // Compare ignoring case and trailing spaces; answered from the index
+    // when it is current
+    dentry_t found_entry;
+    uint32_t entry_pos;
+    int found = find_in_directory(m, m->current_cluster, dirname, &found_entry, &entry_pos) &&
+                (found_entry.DIR_Attr & 0x10); // Directory attribute
+    dentry_t *entry = &found_entry;
 
     if (found) {
         uint32_t new_cluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
-        current_cluster = new_cluster;
+        m->current_cluster = new_cluster;
         // Update the path
         if (strcmp(dirname, "..") == 0) {
             // Handle going up in the directory tree
-            char *last_slash = strrchr(current_path, '/');
-            if (last_slash != current_path) {  // Not at the root
+            char *last_slash = strrchr(m->current_path, '/');
+            if (last_slash != m->current_path) {  // Not at the root
                 *last_slash = '\0';
             } else {
                 *(last_slash + 1) = '\0';  // Stay at the root
-				current_cluster = BootBlock.BPB_RootClus;
+				m->current_cluster = m->boot.BPB_RootClus;
             }
         } else {
             // Append new directory to path
-            if (strlen(current_path) > 1) {
-                strcat(current_path, "/");
+            if (strlen(m->current_path) > 1) {
+                strcat(m->current_path, "/");
             }
-            strcat(current_path, dirname);
+            strcat(m->current_path, dirname);
         }
-        printf("Changing directory to %s\n", dirname);
+        fprintf(m->out, "Changing directory to %s\n", dirname);
     } else {
-        printf("Directory not found\n");
+        command_error(m, "Directory not found\n");
     }
-
-    free(buffer);
 }
 
 // Listing the directories
-void list_directory() {
+void list_directory(mount_t *m) {
+    const index_dir_t *indexed = index_current_dir(m, m->current_cluster);
+    if (indexed != NULL) {
+        fprintf(m->out, "Listing directory contents:\n");
+        for (uint32_t i = 0; i < indexed->entry_count; i++) {
+            char formatted_name[12];
+            format_dirname(m->index->entries[indexed->first_entry + i].entry.DIR_Name, formatted_name);
+            fprintf(m->out, "%s\n", formatted_name);
+        }
+        return;
+    }
+
     uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
+    uint8_t *buffer = read_current_directory_cluster(m, &cluster_size);
     if (!buffer) {
         return; // Memory allocation failed, error handled in the helper function
     }
 
-    printf("Listing directory contents:\n");
+    fprintf(m->out, "Listing directory contents:\n");
     for (int i = 0; i < (int)cluster_size; i += sizeof(dentry_t)) {
         dentry_t *entry = (dentry_t *)(buffer + i);
         if (entry->DIR_Name[0] == 0x00) // No more entries
@@ -245,7 +1239,7 @@ void list_directory() {
         char formatted_name[12];
         format_dirname(entry->DIR_Name, formatted_name);
 
-        printf("%s\n", formatted_name);
+        fprintf(m->out, "%s\n", formatted_name);
     }
 
     free(buffer);
@@ -257,65 +1251,67 @@ void list_directory() {
 // Part 3: Create
 
 // Helper function to check if a directory or file with the given name already exists
-bool check_exists(const char *name) {
-    uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
-    if (!buffer) {
-        return true; // Error handling in the read_current_directory_cluster function
-    }
-
-    dentry_t *entry = NULL;
-    for (int i = 0; i < (int) cluster_size; i += sizeof(dentry_t)) {
-        entry = (dentry_t *)(buffer + i);
-        if (entry->DIR_Name[0] == 0x00) // No more entries
-            break;
-        if ((unsigned char) entry->DIR_Name[0] == 0xE5) // Skipped deleted entry
-            continue;
-
-        char formatted_name[12];
-        format_dirname(entry->DIR_Name, formatted_name);
-
-        if (strcasecmp(formatted_name, name) == 0) {
-            free(buffer);
-            return true; // Found a matching directory or file
-        }
-    }
-
-    free(buffer);
-    return false; // No existing directory or file matches the given name
+bool check_exists(mount_t *m, const char *name) {
+    dentry_t entry;
+    uint32_t entry_pos;
+    return find_in_directory(m, m->current_cluster, name, &entry, &entry_pos);
 }
 
-uint32_t find_free_cluster() {
-    uint32_t fat_offset = BootBlock.BPB_RsvdSecCnt * BootBlock.BPB_BytsPerSec;
-    uint32_t fat_size = BootBlock.BPB_FATSz32 * BootBlock.BPB_BytsPerSec;
-    uint32_t cluster_count = BootBlock.BPB_TotSec32 / BootBlock.BPB_SecPerClus;
+bool cluster_is_free(mount_t *m, uint32_t cluster) {
+    return m->index != NULL ? !index_in_use(m->index, cluster) : fat_get(m, cluster) == 0;
+}
 
-    uint8_t *fat_buffer = malloc(fat_size);
-    if (fat_buffer == NULL) {
-        perror("Memory allocation failed");
-        return 0;
+// First free cluster in [from, end), or end if there is none. Skips FAT
+// windows known to be full, or with an index 64 clusters per bitmap word.
+uint32_t next_free_cluster(mount_t *m, uint32_t from, uint32_t end) {
+    mount_index_t *ix = m->index;
+    if (ix == NULL) {
+        while (from < end) {
+            uint32_t window = from / FAT_WINDOW_ENTRIES;
+            uint32_t window_end = (window + 1) * FAT_WINDOW_ENTRIES < end ? (window + 1) * FAT_WINDOW_ENTRIES : end;
+            if (fat_window_free(m, window) > 0) {
+                pthread_rwlock_wrlock(&m->fat.lock);
+                fat_slot_t *slot = fat_window(m, window);
+                while (slot != NULL && from < window_end && (slot->entries[from % FAT_WINDOW_ENTRIES] & FAT_ENTRY_MASK) != 0)
+                    from++;
+                pthread_rwlock_unlock(&m->fat.lock);
+                if (slot != NULL && from < window_end)
+                    return from;
+            }
+            from = window_end;
+        }
+        return end;
     }
-
-    fseek(imgFile, fat_offset, SEEK_SET);
-    fread(fat_buffer, fat_size, 1, imgFile);
-
-    uint32_t *fat = (uint32_t *)fat_buffer;
-    uint32_t free_cluster = 0;
-
-    for (uint32_t i = 2; i < cluster_count; i++) {
-        uint32_t entry = fat[i];
-        if (entry == 0) {
-            free_cluster = i;
-            break;
+    if (end > ix->cluster_limit)
+        end = ix->cluster_limit;
+    while (from < end) {
+        uint64_t free_bits = ~ix->bitmap[from >> 6] & (~(uint64_t)0 << (from & 63));
+        if (free_bits != 0) {
+            uint32_t cluster = (from & ~63u) + (uint32_t)__builtin_ctzll(free_bits);
+            return cluster < end ? cluster : end;
         }
+        from = (from & ~63u) + 64;
     }
+    return end;
+}
 
-    free(fat_buffer);
-    return free_cluster;
+uint32_t find_free_cluster(mount_t *m) {
+    uint32_t cluster_count = data_cluster_limit(m);
+    uint32_t free_cluster = next_free_cluster(m, 2, cluster_count);
+    return free_cluster < cluster_count ? free_cluster : 0;
 }
 
-void create_dot_entries(uint32_t new_cluster, uint32_t parent_cluster) {
-    uint32_t cluster_size = BootBlock.BPB_BytsPerSec * BootBlock.BPB_SecPerClus;
+// Finds a free cluster and marks it as the end of a chain so the next
+// search does not hand out the same cluster again
+uint32_t allocate_cluster(mount_t *m) {
+    uint32_t cluster = find_free_cluster(m);
+    if (cluster != 0)
+        fat_set(m, cluster, FAT_EOC);
+    return cluster;
+}
+
+void create_dot_entries(mount_t *m, uint32_t new_cluster, uint32_t parent_cluster) {
+    uint32_t cluster_size = m->geo.cluster_size;
     uint8_t *buffer = malloc(cluster_size);
     if (!buffer) {
         perror("Memory allocation failed");
@@ -343,16 +1339,14 @@ void create_dot_entries(uint32_t new_cluster, uint32_t parent_cluster) {
     memcpy(buffer, &dot_entry, sizeof(dentry_t));
     memcpy(buffer + sizeof(dentry_t), &dot_dot_entry, sizeof(dentry_t));
 
-    uint32_t first_sector_of_cluster = ((new_cluster - 2) * BootBlock.BPB_SecPerClus) + (BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32));
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fwrite(buffer, cluster_size, 1, imgFile);
+    img_write(m, buffer, cluster_size, calculate_cluster_offset(m, new_cluster));
 
     free(buffer);
 }
 
-void create_directory(const char *dirname) {
-    if (check_exists(dirname)) {
-        printf("Error: Directory '%s' already exists.\n", dirname);
+void create_directory(mount_t *m, const char *dirname) {
+    if (check_exists(m, dirname)) {
+        command_error(m, "Error: Directory '%s' already exists.\n", dirname);
         return;
     }
 
@@ -366,44 +1360,30 @@ void create_directory(const char *dirname) {
     new_dir_entry.DIR_FileSize = 0;
 
     // Find the first available cluster for the new directory
-    uint32_t new_cluster = find_free_cluster();
+    uint32_t new_cluster = allocate_cluster(m);
     if (new_cluster == 0) {
-        printf("Error: No free clusters available to create the directory.\n");
+        command_error(m, "Error: No free clusters available to create the directory.\n");
         return;
     }
     new_dir_entry.DIR_FstClusLO = new_cluster & 0xFFFF;
     new_dir_entry.DIR_FstClusHI = (new_cluster >> 16) & 0xFFFF;
 
-    // Write the new directory entry to the current directory cluster
-    uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
-    if (!buffer) {
-        return; // Error handling in the read_current_directory_cluster function
-    }
+    // Create the "." and ".." entries in the new directory cluster
+    create_dot_entries(m, new_cluster,m->current_cluster);
 
-    dentry_t *entry = NULL;
-    for (int i = 0; i < (int)cluster_size; i += sizeof(dentry_t)) {
-        entry = (dentry_t *)(buffer + i);
-        if (entry->DIR_Name[0] == 0x00 || (unsigned char)entry->DIR_Name[0] == 0xE5) {
-            memcpy(entry, &new_dir_entry, sizeof(dentry_t));
-            break;
-        }
+    // Write the new directory entry to the current directory, growing it if full
+    if (!directory_add_entry(m, m->current_cluster, &new_dir_entry)) {
+        fat_set(m, new_cluster, 0);
+        command_error(m, "Error: No room in the directory for '%s'.\n", dirname);
+        return;
     }
 
-    uint32_t first_sector_of_cluster = ((current_cluster - 2) * BootBlock.BPB_SecPerClus) + (BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32));
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fwrite(buffer, cluster_size, 1, imgFile);
-    free(buffer);
-
-    // Create the "." and ".." entries in the new directory cluster
-    create_dot_entries(new_cluster,current_cluster);
-
-    printf("Directory '%s' created successfully.\n", dirname);
+    fprintf(m->out, "Directory '%s' created successfully.\n", dirname);
 }
 // Create a new file with the given name
-void create_file(const char *filename) {
-    if (check_exists(filename)) {
-        printf("Error: File '%s' already exists.\n", filename);
+void create_file(mount_t *m, const char *filename) {
+    if (check_exists(m, filename)) {
+        command_error(m, "Error: File '%s' already exists.\n", filename);
         return;
     }
 
@@ -420,47 +1400,284 @@ void create_file(const char *filename) {
 
 	//++++++++ find free cluster +++++++ look at read directory
 	// Find the first available cluster for the new directory
-    uint32_t new_cluster = find_free_cluster();
+    uint32_t new_cluster = allocate_cluster(m);
     if (new_cluster == 0) {
-        printf("Error: No free clusters available to create the file.\n");
+        command_error(m, "Error: No free clusters available to create the file.\n");
         return;
     }
     new_file_entry.DIR_FstClusLO = new_cluster & 0xFFFF;
     new_file_entry.DIR_FstClusHI = (new_cluster >> 16) & 0xFFFF;
 
-    // Write the new file entry to the current directory cluster
-    uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
-    if (!buffer) {
-        return; // Error handling in the read_current_directory_cluster function
+    // Write the new file entry to the current directory, growing it if full
+    if (!directory_add_entry(m, m->current_cluster, &new_file_entry)) {
+        fat_set(m, new_cluster, 0);
+        command_error(m, "Error: No room in the directory for '%s'.\n", filename);
+        return;
     }
 
+    fprintf(m->out, "File '%s' created successfully.\n", filename);
+}
 
-    // Find the first available slot in the current directory cluster
-    dentry_t *entry = NULL;
-    for (int i = 0; i < (int) cluster_size; i += sizeof(dentry_t)) {
-        entry = (dentry_t *)(buffer + i);
-        if (entry->DIR_Name[0] == 0x00 || (unsigned char)entry->DIR_Name[0] == 0xE5) {
-            memcpy(entry, &new_file_entry, sizeof(dentry_t));
+// ============================================================================
+// ============================================================================
+
+// Part 4: Read
+// Index of the open file with the given name, or -1. Caller holds open_files_lock.
+int find_open_file(mount_t *m, const char *filename){
+    for(int i = 0; i < m->open_files_count; i++){//loop through opened files
+        char formatted_name[12];
+        format_dirname(m->open_files[i].entry.DIR_Name, formatted_name);
+        if(strcmp(formatted_name, filename) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Reads or writes len bytes of a file's data starting at pos, following the
+// cluster chain. Returns the number of bytes transferred, which is short if
+// the chain ends first. Uses positional I/O only, so it is safe to call from
+// several threads at once under a shared fs_lock.
+uint32_t transfer_file_data(mount_t *m, const dentry_t *entry, void *buf, uint32_t len, uint32_t pos, bool writing){
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t cluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+
+    //skip whole clusters before pos
+    for(uint32_t skip = pos >> m->geo.cluster_shift; skip > 0 && is_chain_cluster(cluster); skip--){
+        cluster = fat_get(m, cluster);
+    }
+
+    uint32_t done = 0;
+    uint32_t in_cluster = pos & m->geo.cluster_mask;
+    while(done < len && is_chain_cluster(cluster)){
+        uint32_t chunk = cluster_size - in_cluster;
+        if(chunk > len - done){
+            chunk = len - done;
+        }
+        off_t offset = calculate_cluster_offset(m, cluster) + in_cluster;
+        bool ok = writing ? img_write(m, (uint8_t *)buf + done, chunk, offset)
+                          : img_read(m, (uint8_t *)buf + done, chunk, offset);
+        if(!ok){
             break;
         }
+        done += chunk;
+        in_cluster = 0;
+        cluster = fat_get(m, cluster);
     }
+    return done;
+}
 
-    // Write back the modified buffer to the image file
-    uint32_t first_sector_of_cluster = ((current_cluster - 2) * BootBlock.BPB_SecPerClus) + (BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32));
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fwrite(buffer, cluster_size, 1, imgFile);
+// Sequential read-ahead. Each readable handle remembers where its last read
+// ended. While reads keep continuing from there, the next stretch of the
+// cluster chain is fetched in the background into a per-handle buffer, and
+// the window doubles on each fetch up to --readahead. Small sequential
+// reads (log tailing) are then served from memory. Any read or lseek that
+// breaks the pattern drops the buffer and the window starts over.
+
+typedef struct readahead {
+    mount_t *m;            // Image the file lives on
+    pthread_mutex_t lock;
+    pthread_cond_t fetched;
+    dentry_t entry;        // Snapshot of the file for the background fetch
+    uint8_t *data;         // Buffered file bytes [start, start + length)
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t length;
+    uint32_t next_pos;     // Where a sequential reader reads next
+    uint32_t window;       // Current prefetch size
+    bool in_flight;
+    uint32_t fetch_start;  // Range of the outstanding fetch
+    uint32_t fetch_length;
+    uint32_t generation;   // Bumped on drop so stale fetches are discarded
+    bool orphaned;         // Handle closed while a fetch was in flight; the
+                           // fetch frees this when it finishes
+} readahead_t;
+
+// Gives the mount its single background fetcher
+void readahead_start(mount_t *m) {
+    if (m->options.readahead_max == 0)
+        return;
+    m->readahead_pool = malloc(sizeof(thread_pool_t));
+    if (m->readahead_pool != NULL && !pool_init(m->readahead_pool, 1)) {
+        pool_destroy(m->readahead_pool);
+        free(m->readahead_pool);
+        m->readahead_pool = NULL;
+    }
+}
 
-    free(buffer);
+// Runs the fetches still queued and stops the fetcher. The caller must not
+// hold fs_lock, since the fetches take it.
+void readahead_stop(mount_t *m) {
+    if (m->readahead_pool == NULL)
+        return;
+    pool_destroy(m->readahead_pool);
+    free(m->readahead_pool);
+    m->readahead_pool = NULL;
+}
 
-    printf("File '%s' created successfully.\n", filename);
+readahead_t *readahead_create(mount_t *m, const dentry_t *entry) {
+    if (m->options.readahead_max == 0 || m->readahead_pool == NULL)
+        return NULL;
+    readahead_t *ra = calloc(1, sizeof(readahead_t));
+    if (ra == NULL)
+        return NULL;
+    // Room for a full window plus what is left of the previous one
+    ra->capacity = m->options.readahead_max * 2;
+    ra->data = malloc(ra->capacity);
+    if (ra->data == NULL) {
+        free(ra);
+        return NULL;
+    }
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->fetched, NULL);
+    ra->m = m;
+    ra->entry = *entry;
+    return ra;
 }
 
-// ============================================================================
-// ============================================================================
+void readahead_free(readahead_t *ra) {
+    pthread_mutex_destroy(&ra->lock);
+    pthread_cond_destroy(&ra->fetched);
+    free(ra->data);
+    free(ra);
+}
 
-// Part 4: Read
-void open_file(char* input){
+// Closes a handle's read-ahead without waiting for its fetch: the caller
+// may hold fs_lock for writing while the fetch waits for the read lock.
+// A fetch in flight is discarded and frees the state when it finishes.
+void readahead_destroy(readahead_t *ra) {
+    if (ra == NULL)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    ra->generation++;
+    ra->orphaned = ra->in_flight;
+    bool in_flight = ra->in_flight;
+    pthread_mutex_unlock(&ra->lock);
+    if (!in_flight)
+        readahead_free(ra);
+}
+
+// Forgets buffered data and shrinks the window. Caller holds ra->lock.
+void readahead_reset_locked(readahead_t *ra) {
+    ra->generation++;
+    ra->length = 0;
+    ra->window = 0;
+}
+
+// Called when the handle seeks or its file changes underneath it
+void readahead_drop(readahead_t *ra, uint32_t new_pos, const dentry_t *entry) {
+    if (ra == NULL)
+        return;
+    pthread_mutex_lock(&ra->lock);
+    readahead_reset_locked(ra);
+    ra->next_pos = new_pos;
+    if (entry != NULL)
+        ra->entry = *entry;
+    pthread_mutex_unlock(&ra->lock);
+}
+
+void readahead_fetch_job(void *arg) {
+    readahead_t *ra = arg;
+    mount_t *m = ra->m;
+
+    pthread_mutex_lock(&ra->lock);
+    uint32_t generation = ra->generation;
+    uint32_t fetch_start = ra->fetch_start;
+    uint32_t fetch_length = ra->fetch_length;
+    dentry_t entry = ra->entry;
+    bool orphaned = ra->orphaned;
+    pthread_mutex_unlock(&ra->lock);
+
+    uint8_t *tmp = orphaned ? NULL : malloc(fetch_length);
+    uint32_t got = 0;
+    if (tmp != NULL) {
+        pthread_rwlock_rdlock(&m->fs_lock);
+        got = transfer_file_data(m, &entry, tmp, fetch_length, fetch_start, false);
+        pthread_rwlock_unlock(&m->fs_lock);
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    if (tmp != NULL && generation == ra->generation && fetch_start == ra->start + ra->length) {
+        // Drop what the reader has already consumed, then append
+        if (ra->next_pos > ra->start) {
+            uint32_t consumed = ra->next_pos - ra->start;
+            if (consumed > ra->length)
+                consumed = ra->length;
+            memmove(ra->data, ra->data + consumed, ra->length - consumed);
+            ra->start += consumed;
+            ra->length -= consumed;
+        }
+        if (got > ra->capacity - ra->length)
+            got = ra->capacity - ra->length;
+        memcpy(ra->data + ra->length, tmp, got);
+        ra->length += got;
+    }
+    ra->in_flight = false;
+    orphaned = ra->orphaned;
+    pthread_cond_broadcast(&ra->fetched);
+    pthread_mutex_unlock(&ra->lock);
+    free(tmp);
+    if (orphaned)
+        readahead_free(ra);
+}
+
+// Reads through the handle's read-ahead buffer, then schedules the next
+// fetch if the access pattern is sequential. Returns bytes read.
+uint32_t readahead_read(mount_t *m, readahead_t *ra, void *buf, uint32_t len, uint32_t pos) {
+    uint32_t cluster_size = m->geo.cluster_size;
+
+    pthread_mutex_lock(&ra->lock);
+    bool sequential = pos == ra->next_pos;
+    if (!sequential)
+        readahead_reset_locked(ra);
+
+    // If the bytes we want are on their way, wait for them
+    while (ra->in_flight && pos >= ra->fetch_start && pos < ra->fetch_start + ra->fetch_length)
+        pthread_cond_wait(&ra->fetched, &ra->lock);
+
+    uint32_t got;
+    if (ra->length > 0 && pos >= ra->start && pos + len <= ra->start + ra->length) {
+        memcpy(buf, ra->data + (pos - ra->start), len);
+        got = len;
+    } else {
+        pthread_mutex_unlock(&ra->lock);
+        got = transfer_file_data(m, &ra->entry, buf, len, pos, false);
+        pthread_mutex_lock(&ra->lock);
+    }
+    ra->next_pos = pos + got;
+
+    if (sequential && !ra->in_flight) {
+        // Keep fetching once less than half a window is left ahead
+        bool buffered = ra->length > 0 && ra->next_pos >= ra->start && ra->next_pos <= ra->start + ra->length;
+        if (!buffered) {
+            ra->start = ra->next_pos;
+            ra->length = 0;
+        }
+        uint32_t ahead = ra->start + ra->length - ra->next_pos;
+        if (ra->window == 0 || ahead < ra->window / 2) {
+            ra->window = ra->window == 0 ? cluster_size : ra->window * 2;
+            if (ra->window > m->options.readahead_max)
+                ra->window = m->options.readahead_max;
+
+            uint32_t fetch_start = ra->start + ra->length;
+            uint32_t fetch_end = ra->next_pos + ra->window;
+            if (fetch_end > ra->entry.DIR_FileSize)
+                fetch_end = ra->entry.DIR_FileSize;
+            if (fetch_end > fetch_start) {
+                ra->fetch_start = fetch_start;
+                ra->fetch_length = fetch_end - fetch_start;
+                ra->in_flight = true;
+                pthread_mutex_unlock(&ra->lock);
+                pool_submit(m->readahead_pool, readahead_fetch_job, ra);
+                return got;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return got;
+}
+
+void open_file(mount_t *m, char* input){
     while(*input == ' ')
         input++;
 
@@ -470,56 +1687,58 @@ void open_file(char* input){
 
     if(strcmp(flags,"-r") != 0 && strcmp(flags,"-w")!= 0 &&//make sure flags are valid and present
         strcmp(flags, "-rw") != 0 && strcmp(flags, "-wr") != 0){
-            printf("invalid mode: %s", flags);
+            command_error(m, "invalid mode: %s", flags);
             return;
     }
 
-    for(int i = 0; i <open_files_count; i++){//check to make sure file is not already open
-        if(strncmp(open_files[i].entry.DIR_Name, filename, 11) == 0){
-            printf("File alr open: %s\n",filename);
+    pthread_mutex_lock(&m->open_files_lock);
+    for(int i = 0; i <m->open_files_count; i++){//check to make sure file is not already open
+        if(strncmp(m->open_files[i].entry.DIR_Name, filename, 11) == 0){
+            pthread_mutex_unlock(&m->open_files_lock);
+            command_error(m, "File alr open: %s\n",filename);
             return;
         }
     }
-    uint32_t cluster_size;
-    uint8_t* buffer = read_current_directory_cluster(&cluster_size);//read current directory
-    if(!buffer){//return if empty
-        return;
-    }
-
-    bool file_found = false;
-    dentry_t *file_entry = NULL;
-    for(int i = 0; i < (int)cluster_size; i+=sizeof(dentry_t)){
-        file_entry = (dentry_t *)(buffer + i);
-        if(file_entry->DIR_Name[0] == 0x00)break;
-        if((unsigned char)file_entry->DIR_Name[0] == 0xE5) continue;
-
-        char formatted_name[12];
+    pthread_mutex_unlock(&m->open_files_lock);
+
+    //look the file up in the current directory (or its index), names match exactly
+    dentry_t found_entry;
+    dentry_t *file_entry = &found_entry;
+    uint32_t entry_pos = 0;
+    char formatted_name[12] = "";
+    bool file_found = find_in_directory(m, m->current_cluster, filename, file_entry, &entry_pos);
+    if(file_found)
         format_dirname(file_entry->DIR_Name, formatted_name);
-        if(strcmp(formatted_name, filename) == 0 && !(file_entry->DIR_Attr & 0x10)){
-            file_found=true;//file has been found
-            break;
-        }
-    }
-    if(!file_found){//cant open file, prob doesnt exist
-        printf("File not found:%s\n", filename);
-        free(buffer);
+    if(!file_found || strcmp(formatted_name, filename) != 0 || (file_entry->DIR_Attr & 0x10)){//cant open file, prob doesnt exist
+        command_error(m, "File not found:%s\n", filename);
         return;
     }
-    if(open_files_count>=MAX_OPEN_FILES){//too many open, max is 32
-        printf("Max files opened\n");
-        free(buffer);
+    pthread_mutex_lock(&m->open_files_lock);
+    if(m->open_files_count>=MAX_OPEN_FILES){//too many open, max is 32
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Max files opened\n");
         return;
     }
     //file successfully opened, increment counters, set it to open
-    open_files[open_files_count].entry = *file_entry;
-    strcpy(open_files[open_files_count].mode, flags);
-    open_files[open_files_count].file_pos = 0;
-    open_files_count++;
-    printf("File opened successfully: %s with flags: %s\n", filename, flags);
-    free(buffer);//reallocate space
+    m->open_files[m->open_files_count].entry = *file_entry;
+    strcpy(m->open_files[m->open_files_count].mode, flags);
+    m->open_files[m->open_files_count].file_pos = 0;
+    m->open_files[m->open_files_count].ra = strchr(flags, 'r') ? readahead_create(m, file_entry) : NULL;
+    m->open_files[m->open_files_count].wb = strchr(flags, 'w') ? write_behind_create(m) : NULL;
+    m->open_files[m->open_files_count].dir_cluster = m->current_cluster;
+    m->open_files[m->open_files_count].entry_pos = entry_pos;
+    if(strchr(flags, 'w') && m->open_files[m->open_files_count].wb == NULL){
+        readahead_destroy(m->open_files[m->open_files_count].ra);
+        pthread_mutex_unlock(&m->open_files_lock);
+        perror("Mem alloc failed");
+        return;
+    }
+    m->open_files_count++;
+    pthread_mutex_unlock(&m->open_files_lock);
+    fprintf(m->out, "File opened successfully: %s with flags: %s\n", filename, flags);
 }
 
-void close_file(char* input){
+void close_file(mount_t *m, char* input){
 
     while(*input == ' ')
         input++;
@@ -527,50 +1746,49 @@ void close_file(char* input){
     char filename[13];
     sscanf(input, "%s", filename);//seperate input
 
-    bool file_found = false;
-
-    for(int i = 0; i < open_files_count;i++){
-        char formatted_name[12];
-        format_dirname(open_files[i].entry.DIR_Name, formatted_name);
-        if(strcmp(formatted_name, filename) == 0){
-            file_found=true;//found the file
-            break;
-        }
-    }
+    pthread_mutex_lock(&m->open_files_lock);
+    int file_index = find_open_file(m, filename);
 
-
-    if(!file_found){//file not found, type or doesnt exist
-        printf("File not found:%s\n", filename);
+    if(file_index < 0){//file not found, type or doesnt exist
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "File not found:%s\n", filename);
 
         return;
     }
-    for(int y = 0; y<open_files_count-1;y++){
-        open_files[y] = open_files[y+1];//iterate through
+    write_behind_flush(m, &m->open_files[file_index]);
+    readahead_destroy(m->open_files[file_index].ra);
+    write_behind_destroy(m->open_files[file_index].wb);
+    for(int y = file_index; y<m->open_files_count-1;y++){
+        m->open_files[y] = m->open_files[y+1];//iterate through
     }
 
-    open_files_count--;//file found, close it out
-    printf("file closed successfully: %s\n", filename);
+    m->open_files_count--;//file found, close it out
+    pthread_mutex_unlock(&m->open_files_lock);
+    fprintf(m->out, "file closed successfully: %s\n", filename);
 }
 
-void list_all(){
-    if(open_files_count == 0){//no files to list
-        printf("No files to open currently.\n");
+void list_all(mount_t *m){
+    pthread_mutex_lock(&m->open_files_lock);
+    if(m->open_files_count == 0){//no files to list
+        pthread_mutex_unlock(&m->open_files_lock);
+        fprintf(m->out, "No files to open currently.\n");
         return;
     }
 
-    printf("active open files:\n");
-    for(int i = 0; i<open_files_count;i++){//iterate through the files, print mode and permissions and name
+    fprintf(m->out, "active open files:\n");
+    for(int i = 0; i<m->open_files_count;i++){//iterate through the files, print mode and permissions and name
         char formatted_name[12];
-        format_dirname(open_files[i].entry.DIR_Name, formatted_name);
-        printf("%-11s\t%s\t%u\n", formatted_name, open_files[i].mode, open_files[i].file_pos);
+        format_dirname(m->open_files[i].entry.DIR_Name, formatted_name);
+        fprintf(m->out, "%-11s\t%s\t%u\n", formatted_name, m->open_files[i].mode, m->open_files[i].file_pos);
     }
+    pthread_mutex_unlock(&m->open_files_lock);
 }
 
-void set_file_offset(char *input){
-    char filename[13];
-    int offset;
-    char pos_str[10];
-    sscanf(input, "%s %d %s", filename, &offset, pos_str);//seperate input
+void set_file_offset(mount_t *m, char *input){
+    char filename[13] = "";
+    int offset = 0;
+    char pos_str[10] = "";
+    sscanf(input, "%12s %d %9s", filename, &offset, pos_str);//seperate input
 
     int test;//get different options
     if(strcmp(pos_str, "SEEK_SET") == 0){
@@ -580,206 +1798,373 @@ void set_file_offset(char *input){
     }else if(strcmp(pos_str, "SEEK_END") == 0){
         test = SEEK_END;
     }else {
-        printf("Invalid choice: %s\n", pos_str);
+        command_error(m, "Invalid choice: %s\n", pos_str);
         return;    
     }
 
-    for(int i = 0; i <open_files_count; i++){
-        char formatted_name[12];
-        format_dirname(open_files[i].entry.DIR_Name, formatted_name);//loop through opened files
-        if(strcmp(formatted_name,filename) ==0){
-            uint32_t new_pos;
-            switch(test){//change offset according to input
-                case SEEK_SET:
-                    new_pos = offset;
-                    break;
-                case SEEK_CUR:
-                    new_pos = open_files[i].file_pos + offset;
-                    break;
-                case SEEK_END:
-                    new_pos = open_files[i].entry.DIR_FileSize+offset;
-                    break;
-                default:
-                    printf("invalid operation\n");
-                    return;
-            }
-            if(new_pos > open_files[i].entry.DIR_FileSize){
-                printf("Error: pos out of bounds.\n");
-                return;
-            }
-            open_files[i].file_pos = new_pos;//successful
-            printf("File pos updated: %s to %u\n", filename, new_pos);
-            return;
-        }
+    pthread_mutex_lock(&m->open_files_lock);
+    int i = find_open_file(m, filename);
+    if(i < 0){
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "File not open: %s\n", filename);
+        return;
     }
-    printf("File not open: %s\n", filename);
-}
 
-uint32_t calculate_file_offset(dentry_t entry){
-    uint32_t first_sector_of_cluster = ((entry.DIR_FstClusLO -2) * BootBlock.BPB_SecPerClus) + BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32);
-    return first_sector_of_cluster * BootBlock.BPB_BytsPerSec;
+    uint32_t new_pos;
+    switch(test){//change offset according to input
+        case SEEK_SET:
+            new_pos = offset;
+            break;
+        case SEEK_CUR:
+            new_pos = m->open_files[i].file_pos + offset;
+            break;
+        case SEEK_END:
+            new_pos = m->open_files[i].entry.DIR_FileSize+offset;
+            break;
+        default:
+            pthread_mutex_unlock(&m->open_files_lock);
+            command_error(m, "invalid operation\n");
+            return;
+    }
+    if(new_pos > m->open_files[i].entry.DIR_FileSize){
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: pos out of bounds.\n");
+        return;
+    }
+    if(new_pos != m->open_files[i].file_pos){//random access, stop reading ahead
+        readahead_drop(m->open_files[i].ra, new_pos, NULL);
+    }
+    m->open_files[i].file_pos = new_pos;//successful
+    pthread_mutex_unlock(&m->open_files_lock);
+    fprintf(m->out, "File pos updated: %s to %u\n", filename, new_pos);
 }
 
-void read_file(char *input){
+void read_file(mount_t *m, char *input){
     char filename[13];
     int size;
     sscanf(input, "%s %d", filename, &size);//format the input
 
-    bool file_open = false;
-    int file_index = -1;
-
-    for(int i = 0; i < open_files_count; i++){//loop through opened files
-        char formatted_name[12];
-        format_dirname(open_files[i].entry.DIR_Name, formatted_name);
-        if(strcmp(formatted_name, filename) == 0){
-            file_open=true;//file found
-            file_index = i;
-            break;
-        }
-    }
+    //take a snapshot of the handle so the data read below runs without
+    //holding the open-file table
+    pthread_mutex_lock(&m->open_files_lock);
+    int file_index = find_open_file(m, filename);
 
-    if(!file_open){
-        printf("Error: file '%s' not open or does not exist.\n", filename);
+    if(file_index < 0){
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: file '%s' not open or does not exist.\n", filename);
         return;
     }
-    if(open_files[file_index].entry.DIR_Attr & 0x10){//invalid input
-        printf("Error: '%s' is a directory.\n", filename);
+    if(m->open_files[file_index].entry.DIR_Attr & 0x10){//invalid input
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: '%s' is a directory.\n", filename);
         return;
     }
-    if (strchr(open_files[file_index].mode, 'r') == NULL) {//invalid permissions
-        printf("Error: file '%s'not opened for reading.\n" ,filename);
+    if (strchr(m->open_files[file_index].mode, 'r') == NULL) {//invalid permissions
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: file '%s'not opened for reading.\n" ,filename);
         return;
     }
+    dentry_t entry = m->open_files[file_index].entry;
+    uint32_t start_pos = m->open_files[file_index].file_pos;
+    readahead_t *ra = m->open_files[file_index].ra;
+    pthread_mutex_unlock(&m->open_files_lock);
 
     //open the file
-    uint32_t start_pos = open_files[file_index].file_pos;
     uint32_t end_pos = start_pos + size;
-    if(end_pos > open_files[file_index].entry.DIR_FileSize){
-        end_pos = open_files[file_index].entry.DIR_FileSize;
+    if(end_pos > entry.DIR_FileSize){
+        end_pos = entry.DIR_FileSize;
     }
-    //calculate appropriate offset
-    fseek(imgFile, calculate_file_offset(open_files[file_index].entry), SEEK_SET);
-    fseek(imgFile, start_pos, SEEK_CUR);
 
     //current size of text
     int read_size = end_pos - start_pos;
-    char *buffer = malloc(read_size);
+    char *buffer = malloc(read_size > 0 ? read_size : 1);
     if(buffer == NULL){//something happened?
         perror("Mem alloc failed");
         return;
     }
-    fread(buffer, read_size, 1, imgFile);
-    printf("Data read: %.*s\n", read_size, buffer);
+    if(ra != NULL){
+        read_size = readahead_read(m, ra, buffer, read_size, start_pos);
+    }else{
+        read_size = transfer_file_data(m, &entry, buffer, read_size, start_pos, false);
+    }
+    fprintf(m->out, "Data read: %.*s\n", read_size, buffer);
 
-    open_files[file_index].file_pos = end_pos;
+    pthread_mutex_lock(&m->open_files_lock);
+    file_index = find_open_file(m, filename);
+    if(file_index >= 0){
+        m->open_files[file_index].file_pos = start_pos + read_size;
+    }
+    pthread_mutex_unlock(&m->open_files_lock);
     free(buffer);
 }
 
 // ============================================================================
 // ============================================================================
 
-void extend_file(dentry_t *entry, uint32_t new_file_size) {
-    uint32_t current_size = entry->DIR_FileSize;
-    uint32_t cluster_size = BootBlock.BPB_BytsPerSec * BootBlock.BPB_SecPerClus;
+// Part 5: Write
+
+// Write-behind. Each writable handle gathers consecutive writes in a
+// buffer of WRITE_BEHIND_BYTES (whole clusters) and writes them out in one
+// go when it fills, or when any other command runs (lseek, close, sync,
+// and anything else that might look at the image). A flush grows the chain
+// from the cached tail cluster instead of walking it, writes each run of
+// adjacent clusters with one pwrite, and stores DIR_FileSize once. The
+// cached chain positions are only trusted while the FAT generation is the
+// one the last flush left behind; any other change to the FAT (truncate,
+// compactdir, another handle's flush) makes the next flush walk again.
+#define WRITE_BEHIND_BYTES (64 * 1024)
+
+typedef struct write_behind {
+    uint8_t *data;         // Pending bytes for file positions [start, start + length)
+    uint32_t capacity;
+    uint32_t start;
+    uint32_t length;
+    bool chain_known;      // tail_cluster and chain_length are valid
+    uint32_t tail_cluster; // Last cluster of the chain
+    uint32_t chain_length;
+    uint32_t hint_cluster; // A cluster of the chain and its index, where the
+    uint32_t hint_index;   // last flush ended (0 if none)
+    uint32_t generation;   // m->fat_generation the positions above match
+} write_behind_t;
+
+write_behind_t *write_behind_create(mount_t *m) {
+    write_behind_t *wb = calloc(1, sizeof(write_behind_t));
+    if (wb == NULL)
+        return NULL;
+    wb->capacity = (WRITE_BEHIND_BYTES + m->geo.cluster_size - 1) >> m->geo.cluster_shift << m->geo.cluster_shift;
+    wb->data = malloc(wb->capacity);
+    if (wb->data == NULL) {
+        free(wb);
+        return NULL;
+    }
+    return wb;
+}
 
-    if (new_file_size <= current_size) {
-        // File size is not increasing, no need to extend
+void write_behind_destroy(write_behind_t *wb) {
+    if (wb == NULL)
         return;
-    }
+    free(wb->data);
+    free(wb);
+}
 
-    uint32_t cur_cluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
-    uint32_t next_cluster = 0;
-    // uint32_t data_start = BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32);
+// Forget the cached chain positions; other commands may have moved it
+void write_behind_forget(write_behind_t *wb) {
+    wb->chain_known = false;
+    wb->hint_cluster = 0;
+}
 
-    // Traverse the existing cluster chain
-    while (cur_cluster != 0) {
-        uint32_t fat_offset = cur_cluster * sizeof(uint32_t);
-        fseek(imgFile, BootBlock.BPB_RsvdSecCnt * BootBlock.BPB_BytsPerSec + fat_offset, SEEK_SET);
-        fread(&next_cluster, sizeof(uint32_t), 1, imgFile);
+// Cluster at the given index of the handle's chain, starting from the
+// hint when it is not past it
+uint32_t write_behind_cluster_at(mount_t *m, open_file_t *file, uint32_t index) {
+    write_behind_t *wb = file->wb;
+    uint32_t cluster = entry_first_cluster(&file->entry), at = 0;
+    if (wb->hint_cluster != 0 && wb->hint_index <= index) {
+        cluster = wb->hint_cluster;
+        at = wb->hint_index;
+    }
+    for (; at < index && is_chain_cluster(cluster); at++)
+        cluster = fat_get(m, cluster);
+    return cluster;
+}
 
-        if (current_size + cluster_size >= new_file_size) {
-            // Enough space in the existing cluster chain
-            break;
+// Makes the chain long enough to hold size bytes
+bool write_behind_extend(mount_t *m, open_file_t *file, uint32_t size) {
+    write_behind_t *wb = file->wb;
+    if (!wb->chain_known) {
+        wb->chain_length = 0;
+        wb->tail_cluster = 0;
+        for (uint32_t c = entry_first_cluster(&file->entry); is_chain_cluster(c) && wb->chain_length < m->fat_cache_entries; c = fat_get(m, c)) {
+            wb->tail_cluster = c;
+            wb->chain_length++;
         }
+        wb->chain_known = true;
+    }
 
-        current_size += cluster_size;
-        cur_cluster = next_cluster;
+    uint32_t needed = (uint32_t)(((uint64_t)size + m->geo.cluster_size - 1) >> m->geo.cluster_shift);
+    if (needed <= wb->chain_length)
+        return true;
+    uint32_t count = needed - wb->chain_length;
+    uint32_t *chain = allocate_chain(m, count);
+    if (chain == NULL) {
+        command_error(m, "Error: No free clusters available to extend the file.\n");
+        return false;
     }
+    if (wb->chain_length == 0)
+        set_entry_first_cluster(&file->entry, chain[0]);
+    else
+        fat_set(m, wb->tail_cluster, chain[0]);
+    wb->tail_cluster = chain[count - 1];
+    wb->chain_length = needed;
+    free(chain);
+    return true;
+}
 
-    // Allocate new clusters as needed
-    while (current_size < new_file_size) {
-        uint32_t free_cluster = find_free_cluster();
-        if (free_cluster == 0) {
-            printf("Error: No free clusters available to extend the file.\n");
-            return;
+// Writes a handle's pending data to the image and its size to its entry
+bool write_behind_flush(mount_t *m, open_file_t *file) {
+    write_behind_t *wb = file->wb;
+    if (wb == NULL || wb->length == 0)
+        return true;
+
+    if (wb->generation != m->fat_generation)
+        write_behind_forget(wb);
+    uint32_t end = wb->start + wb->length;
+    uint32_t first = entry_first_cluster(&file->entry);
+    bool ok = write_behind_extend(m, file, end);
+
+    uint32_t done = 0;
+    uint32_t index = wb->start >> m->geo.cluster_shift;
+    uint32_t cluster = ok ? write_behind_cluster_at(m, file, index) : 0;
+    while (ok && done < wb->length && is_chain_cluster(cluster)) {
+        uint32_t pos = wb->start + done;
+        uint32_t chunk = m->geo.cluster_size - (pos & m->geo.cluster_mask);
+        uint32_t last = cluster;
+        for (uint32_t next; chunk < wb->length - done && (next = fat_get(m, last)) == last + 1; chunk += m->geo.cluster_size) {
+            last = next;
+            index++;
         }
+        if (chunk > wb->length - done)
+            chunk = wb->length - done;
+        ok = img_write(m, wb->data + done, chunk, calculate_cluster_offset(m, cluster) + (pos & m->geo.cluster_mask));
+        done += chunk;
+        wb->hint_cluster = last;
+        wb->hint_index = index;
+        cluster = fat_get(m, last);
+        index++;
+    }
+    if (done < wb->length)
+        ok = false;
+
+    if (end > file->entry.DIR_FileSize || entry_first_cluster(&file->entry) != first) {
+        if (ok && end > file->entry.DIR_FileSize)
+            file->entry.DIR_FileSize = end;
+        off_t entry_offset = directory_entry_offset(m, file->dir_cluster, file->entry_pos);
+        if (entry_offset < 0 || !img_write(m, &file->entry, sizeof(dentry_t), entry_offset))
+            ok = false;
+    }
+    readahead_drop(file->ra, file->file_pos, &file->entry);
+    wb->length = 0;
+    wb->generation = m->fat_generation;
+    if (!ok) {
+        char formatted_name[12];
+        format_dirname(file->entry.DIR_Name, formatted_name);
+        command_error(m, "Error: could not write buffered data for '%s'.\n", formatted_name);
+    }
+    return ok;
+}
 
-        if (next_cluster == 0) {
-            // First cluster in the chain
-            entry->DIR_FstClusLO = free_cluster & 0xFFFF;
-            entry->DIR_FstClusHI = (free_cluster >> 16) & 0xFFFF;
-        } else {
-            // Update the FAT entry for the previous cluster
-            uint32_t fat_offset = next_cluster * sizeof(uint32_t);
-            fseek(imgFile, BootBlock.BPB_RsvdSecCnt * BootBlock.BPB_BytsPerSec + fat_offset, SEEK_SET);
-            fwrite(&free_cluster, sizeof(uint32_t), 1, imgFile);
-        }
+// Queues len bytes for file position pos, flushing as the buffer fills.
+// The first fill ends on a cluster boundary so later ones are whole clusters.
+bool write_behind_add(mount_t *m, open_file_t *file, const void *data, uint32_t len, uint32_t pos) {
+    write_behind_t *wb = file->wb;
+    if (wb->length > 0 && pos != wb->start + wb->length && !write_behind_flush(m, file))
+        return false;
+    while (len > 0) {
+        if (wb->length == 0)
+            wb->start = pos;
+        uint32_t room = wb->capacity - (wb->start & m->geo.cluster_mask) - wb->length;
+        uint32_t chunk = len < room ? len : room;
+        memcpy(wb->data + wb->length, data, chunk);
+        wb->length += chunk;
+        data = (const uint8_t *)data + chunk;
+        pos += chunk;
+        len -= chunk;
+        if (chunk == room && !write_behind_flush(m, file))
+            return false;
+    }
+    return true;
+}
+
+// True if any handle has unwritten data. Caller holds open_files_lock.
+bool writes_pending(mount_t *m) {
+    for (int i = 0; i < m->open_files_count; i++) {
+        if (m->open_files[i].wb != NULL && m->open_files[i].wb->length > 0)
+            return true;
+    }
+    return false;
+}
+
+// Flushes every handle. Caller holds fs_lock exclusively.
+void flush_all_writes(mount_t *m) {
+    pthread_mutex_lock(&m->open_files_lock);
+    for (int i = 0; i < m->open_files_count; i++) {
+        if (m->open_files[i].wb == NULL)
+            continue;
+        write_behind_flush(m, &m->open_files[i]);
+        write_behind_forget(m->open_files[i].wb);
+    }
+    pthread_mutex_unlock(&m->open_files_lock);
+}
+
+void extend_file(mount_t *m, dentry_t *entry, uint32_t new_file_size) {
+    uint32_t cluster_size = m->geo.cluster_size;
+
+    if (new_file_size <= entry->DIR_FileSize) {
+        // File size is not increasing, no need to extend
+        return;
+    }
+
+    uint32_t clusters_needed = (new_file_size + cluster_size - 1) / cluster_size;
+    uint32_t clusters_have = 0;
+    uint32_t last_cluster = 0;
+
+    // Traverse the existing cluster chain
+    uint32_t cur_cluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+    while (is_chain_cluster(cur_cluster)) {
+        clusters_have++;
+        last_cluster = cur_cluster;
+        cur_cluster = fat_get(m, cur_cluster);
+    }
 
-        next_cluster = free_cluster;
-        current_size += cluster_size;
+    // Allocate the missing clusters as one chain, as contiguous as free
+    // space allows, and link it onto the end
+    if (clusters_have < clusters_needed) {
+        uint32_t *chain = allocate_chain(m, clusters_needed - clusters_have);
+        if (chain == NULL) {
+            command_error(m, "Error: No free clusters available to extend the file.\n");
+            return;
+        }
+        if (last_cluster == 0)
+            set_entry_first_cluster(entry, chain[0]); // First cluster in the chain
+        else
+            fat_set(m, last_cluster, chain[0]);
+        free(chain);
     }
 
     // Update the file size
     entry->DIR_FileSize = new_file_size;
 }
 
-void write_file(char *input) {
+void write_file(mount_t *m, char *input) {
     char filename[13];
     char string[256];
-    sscanf(input, "%s %256s", filename, string);
-
-    bool file_open = false;
-    int file_index = -1;
+    sscanf(input, "%s %255s", filename, string);
 
+    pthread_mutex_lock(&m->open_files_lock);
+    int file_index = find_open_file(m, filename);
 
-    for(int i = 0; i < open_files_count; i++){//loop through opened files
-        char formatted_name[12];
-        format_dirname(open_files[i].entry.DIR_Name, formatted_name);
-        if(strcmp(formatted_name, filename) == 0){
-            file_open=true;//file found
-            file_index = i;
-            break;
-        }
-    }
-    
-    if (!file_open) {
-        printf("Error: file '%s' not open or does not exist.\n", filename);
+    if (file_index < 0) {
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: file '%s' not open or does not exist.\n", filename);
         return;
     }
 
-    if (open_files[file_index].entry.DIR_Attr & 0x10) {
-        printf("Error: '%s' is a directory.\n", filename);
+    if (m->open_files[file_index].entry.DIR_Attr & 0x10) {
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: '%s' is a directory.\n", filename);
         return;
     }
 
-    if (strchr(open_files[file_index].mode, 'w') == NULL) {
-        printf("Error: file '%s' not opened for writing.\n", filename);
+    if (strchr(m->open_files[file_index].mode, 'w') == NULL) {
+        pthread_mutex_unlock(&m->open_files_lock);
+        command_error(m, "Error: file '%s' not opened for writing.\n", filename);
         return;
     }
 
-    uint32_t file_offset = open_files[file_index].file_pos;
+    open_file_t *file = &m->open_files[file_index];
     uint32_t string_length = strlen(string);
-    uint32_t new_file_size = file_offset + string_length;
-
-    if (new_file_size > open_files[file_index].entry.DIR_FileSize) {
-        extend_file(&open_files[file_index].entry, new_file_size);
-    }
-
-    fseek(imgFile, calculate_file_offset(open_files[file_index].entry), SEEK_SET);
-    fseek(imgFile, file_offset, SEEK_CUR);
-    fwrite(string, sizeof(char), string_length, imgFile);
-
-    // open_files[file_index].file_pos = new_file_size;
+    if (write_behind_add(m, file, string, string_length, file->file_pos))
+        file->file_pos += string_length;
+    pthread_mutex_unlock(&m->open_files_lock);
 }
 
 // ============================================================================
@@ -787,46 +2172,22 @@ void write_file(char *input) {
 
 // Part 6: rm and rmdir
 
-uint8_t* read_directory_cluster(uint32_t* cluster_size, uint32_t dir_cluster) {
-    *cluster_size = BootBlock.BPB_BytsPerSec * BootBlock.BPB_SecPerClus;
-    uint8_t *buffer = malloc(*cluster_size);
-    if (!buffer) {
-        perror("Memory allocation failed");
-        return NULL;
-    }
-
-    uint32_t first_data_sector = BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32);
-    uint32_t first_sector_of_cluster = ((dir_cluster - 2) * BootBlock.BPB_SecPerClus) + first_data_sector;
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fread(buffer, *cluster_size, 1, imgFile);
-    return buffer;
+uint8_t* read_directory_cluster(mount_t *m, uint32_t* cluster_size, uint32_t dir_cluster) {
+    return read_directory_chain(m, dir_cluster, cluster_size);
 }
 
-void reclaim_file_clusters(dentry_t *entry) {
-    uint32_t current_cluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
-    uint32_t next_cluster = 0;
-    // uint32_t data_start = BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32);
-
-    while (current_cluster != 0) {
-        uint32_t fat_offset = current_cluster * sizeof(uint32_t);
-        fseek(imgFile, BootBlock.BPB_RsvdSecCnt * BootBlock.BPB_BytsPerSec + fat_offset, SEEK_SET);
-        fread(&next_cluster, sizeof(uint32_t), 1, imgFile);
-
-        // Mark the cluster as free in the FAT
-        uint32_t free_cluster = 0;
-        fseek(imgFile, BootBlock.BPB_RsvdSecCnt * BootBlock.BPB_BytsPerSec + fat_offset, SEEK_SET);
-        fwrite(&free_cluster, sizeof(uint32_t), 1, imgFile);
-
-        current_cluster = next_cluster;
-    }
+void reclaim_file_clusters(mount_t *m, dentry_t *entry) {
+    // The entry is already marked deleted, so the chain is unreachable;
+    // the background reclaimer marks the clusters free in the FAT
+    reclaim_chain(m, entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16));
 }
 
-void remove_file(char *input) {
+void remove_file(mount_t *m, char *input) {
     char filename[13];
     sscanf(input, "%s", filename);
 
     uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
+    uint8_t *buffer = read_current_directory_cluster(m, &cluster_size);
     if (!buffer) {
         return; // Error handling in the read_current_directory_cluster function
     }
@@ -845,21 +2206,24 @@ void remove_file(char *input) {
 
         if (strcasecmp(formatted_name, filename) == 0) {
             if (entry->DIR_Attr & 0x10) { // Directory attribute
-                printf("Error: '%s' is a directory.\n", filename);
+                command_error(m, "Error: '%s' is a directory.\n", filename);
                 free(buffer);
                 return;
             }
 
             // Check if the file is opened
-            for (int j = 0; j < open_files_count; j++) {
+            pthread_mutex_lock(&m->open_files_lock);
+            for (int j = 0; j < m->open_files_count; j++) {
                 char open_name[12];
-                format_dirname(open_files[j].entry.DIR_Name, open_name);
+                format_dirname(m->open_files[j].entry.DIR_Name, open_name);
                 if (strcasecmp(open_name, filename) == 0) {
-                    printf("Error: File '%s' is currently open.\n", filename);
+                    pthread_mutex_unlock(&m->open_files_lock);
+                    command_error(m, "Error: File '%s' is currently open.\n", filename);
                     free(buffer);
                     return;
                 }
             }
+            pthread_mutex_unlock(&m->open_files_lock);
 
             entry_index = i;
             break;
@@ -867,7 +2231,7 @@ void remove_file(char *input) {
     }
 
     if (entry_index == -1) {
-        printf("Error: File '%s' not found.\n", filename);
+        command_error(m, "Error: File '%s' not found.\n", filename);
         free(buffer);
         return;
     }
@@ -875,25 +2239,24 @@ void remove_file(char *input) {
     // Remove the file entry from the directory
     entry->DIR_Name[0] = 0xE5; // Mark the entry as deleted
 
-    // Write back the modified buffer to the image file
-    uint32_t first_sector_of_cluster = ((current_cluster - 2) * BootBlock.BPB_SecPerClus) + (BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32));
-    fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-    fwrite(buffer, cluster_size, 1, imgFile);
+    // Write back the modified entry; it may sit in any cluster of the directory
+    img_write(m, entry, sizeof(dentry_t), directory_entry_offset(m, m->current_cluster, entry_index));
 
-    free(buffer);
+    // Reclaim the actual file data (entry points into buffer)
+    reclaim_file_clusters(m, entry);
 
-    // Reclaim the actual file data
-    reclaim_file_clusters(entry);
+    free(buffer);
+    compact_directory_if_sparse(m, m->current_cluster);
 
-    printf("File '%s' deleted successfully.\n", filename);
+    fprintf(m->out, "File '%s' deleted successfully.\n", filename);
 }
 
-void remove_directory(const char *input) {
+void remove_directory(mount_t *m, const char *input) {
     char dirname[13];
     sscanf(input, "%s", dirname);
 
     uint32_t cluster_size;
-    uint8_t *buffer = read_current_directory_cluster(&cluster_size);
+    uint8_t *buffer = read_current_directory_cluster(m, &cluster_size);
     if (!buffer) {
         return; // Error handling in the read_current_directory_cluster function
     }
@@ -912,7 +2275,7 @@ void remove_directory(const char *input) {
 
         if (strcasecmp(formatted_name, dirname) == 0) {
             if (!(entry->DIR_Attr & 0x10)) { // Not a directory
-                printf("Error: '%s' is not a directory.\n", dirname);
+                command_error(m, "Error: '%s' is not a directory.\n", dirname);
                 free(buffer);
                 return;
             }
@@ -923,7 +2286,7 @@ void remove_directory(const char *input) {
     }
 
     if (entry_index == -1) {
-        printf("Error: Directory '%s' not found.\n", dirname);
+        command_error(m, "Error: Directory '%s' not found.\n", dirname);
         free(buffer);
         return;
     }
@@ -931,7 +2294,7 @@ void remove_directory(const char *input) {
     // Check if the directory is empty
     uint32_t dir_cluster = entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
     uint32_t dir_cluster_size;
-    uint8_t *dir_buffer = read_directory_cluster(&dir_cluster_size,dir_cluster);
+    uint8_t *dir_buffer = read_directory_cluster(m, &dir_cluster_size,dir_cluster);
 
     if (!dir_buffer) {
         free(buffer);
@@ -960,20 +2323,19 @@ void remove_directory(const char *input) {
         // Remove the directory entry from the current directory
         entry->DIR_Name[0] = 0xE5; // Mark the entry as deleted
 
-        // Write back the modified buffer to the image file
-        uint32_t first_sector_of_cluster = ((current_cluster - 2) * BootBlock.BPB_SecPerClus) + (BootBlock.BPB_RsvdSecCnt + (BootBlock.BPB_NumFATs * BootBlock.BPB_FATSz32));
-        fseek(imgFile, first_sector_of_cluster * BootBlock.BPB_BytsPerSec, SEEK_SET);
-        fwrite(buffer, cluster_size, 1, imgFile);
+        // Write back the modified entry; it may sit in any cluster of the directory
+        img_write(m, entry, sizeof(dentry_t), directory_entry_offset(m, m->current_cluster, entry_index));
+
+        // Reclaim the clusters occupied by the directory (entry points into buffer)
+        reclaim_file_clusters(m, entry);
 
         free(buffer);
         free(dir_buffer);
+        compact_directory_if_sparse(m, m->current_cluster);
 
-        // Reclaim the clusters occupied by the directory
-        reclaim_file_clusters(entry);
-
-        printf("Directory '%s' removed successfully.\n", dirname);
+        fprintf(m->out, "Directory '%s' removed successfully.\n", dirname);
     } else {
-        printf("Error: Directory '%s' is not empty.\n", dirname);
+        command_error(m, "Error: Directory '%s' is not empty.\n", dirname);
         free(buffer);
         free(dir_buffer);
     }
@@ -982,61 +2344,3499 @@ void remove_directory(const char *input) {
 // ============================================================================
 // ============================================================================
 
-// Main Functions
+// Part 7: Cluster chains and directory trees
 
-void main_process() {
-    char command[256];
-    while (1) {
-        display_prompt();
-        fgets(command, 256, stdin);
+#define TREE_MAX_DEPTH 64
 
-        // remove trailing newline
-        command[strcspn(command, "\n")] = 0;
+// First data cluster of a directory entry
+uint32_t entry_first_cluster(const dentry_t *entry) {
+    return entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+}
 
-        if (strcmp(command, "exit") == 0)
-            exitProgram();
-        else if (strcmp(command, "info") == 0)
-            getInfo();
-        else if (strncmp(command, "cd ", 3) == 0)
-            change_directory(command + 3); // Skip "cd "
-        else if (strcmp(command, "ls") == 0)
-            list_directory();
-        else if (strncmp(command, "mkdir ", 6) == 0)
-            create_directory(command + 6); // Skip "mkdir "
-        else if (strncmp(command, "creat ", 6) == 0)
-            create_file(command + 6); // Skip "creat "
-        else if(strncmp(command, "open ", 5) == 0)
-            open_file(command + 5);
-        else if(strncmp(command, "close ", 6) == 0)
-            close_file(command + 6);
-        else if(strncmp(command, "lsof", 5) == 0)
-            list_all();
-        else if(strncmp(command, "lseek ", 6) == 0)
-            set_file_offset(command + 6);
-        else if(strncmp(command, "read ", 5) == 0)
-            read_file(command + 5);
-        else if(strncmp(command, "write ", 6) == 0)
-            write_file(command + 6);
-        else if(strncmp(command, "rm ", 3) == 0)
-            remove_file(command + 3);
-        else if(strncmp(command, "rmdir ", 6) == 0)
-            remove_directory(command + 6);
-        else
-            printf("Invalid command.\n");
+void set_entry_first_cluster(dentry_t *entry, uint32_t cluster) {
+    entry->DIR_FstClusLO = cluster & 0xFFFF;
+    entry->DIR_FstClusHI = (cluster >> 16) & 0xFFFF;
+}
+
+// True for entries that name a real file or directory (not free, deleted,
+// a long-name fragment or the volume label)
+bool is_live_entry(const dentry_t *entry) {
+    if (entry->DIR_Name[0] == 0x00 || (unsigned char)entry->DIR_Name[0] == 0xE5)
+        return false;
+    if ((entry->DIR_Attr & 0x0F) == 0x0F || (entry->DIR_Attr & 0x08))
+        return false;
+    return true;
+}
+
+// True for the "." and ".." entries
+bool is_dot_entry(const dentry_t *entry) {
+    char formatted_name[12];
+    format_dirname(entry->DIR_Name, formatted_name);
+    return strcmp(formatted_name, ".") == 0 || strcmp(formatted_name, "..") == 0;
+}
+
+// Reads every cluster of a directory into one buffer. Caller frees.
+uint8_t *read_directory_chain(mount_t *m, uint32_t dir_cluster, uint32_t *size) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t count;
+    uint32_t *chain = get_cluster_chain(m, dir_cluster, &count);
+    *size = 0;
+    if (chain == NULL)
+        return NULL;
+
+    uint8_t *buffer = malloc((size_t)count * cluster_size);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        free(chain);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!img_read(m, buffer + (size_t)i * cluster_size, cluster_size, calculate_cluster_offset(m, chain[i]))) {
+            free(buffer);
+            free(chain);
+            return NULL;
+        }
     }
+    free(chain);
+    *size = count * cluster_size;
+    return buffer;
 }
 
-int main(int argc, char const *argv[])
-{
-    // Open and mount FAT32 File
-    if (argc != 2) {
-        printf("Usage: filesys <FAT32 ISO>\n");
-        return 1;
+// Image offset of the entry at byte pos within a directory, or -1
+off_t directory_entry_offset(mount_t *m, uint32_t dir_cluster, uint32_t pos) {
+    uint32_t cluster = dir_cluster;
+    for (uint32_t skip = pos >> m->geo.cluster_shift; skip > 0 && is_chain_cluster(cluster); skip--)
+        cluster = fat_get(m, cluster);
+    if (!is_chain_cluster(cluster))
+        return -1;
+    return calculate_cluster_offset(m, cluster) + (pos & m->geo.cluster_mask);
+}
+
+// Looks up name in a directory. On success copies out the entry and its
+// byte position within the directory.
+bool find_in_directory(mount_t *m, uint32_t dir_cluster, const char *name, dentry_t *found, uint32_t *entry_pos) {
+    if (m->index != NULL && m->index->dirs_current) {
+        int indexed = index_find_entry(m, dir_cluster, name, found, entry_pos);
+        if (indexed >= 0)
+            return indexed;
+    }
+
+    uint32_t size;
+    uint8_t *buffer = read_directory_chain(m, dir_cluster, &size);
+    if (buffer == NULL)
+        return false;
+
+    bool match = false;
+    for (uint32_t i = 0; i < size; i += sizeof(dentry_t)) {
+        dentry_t *entry = (dentry_t *)(buffer + i);
+        if (entry->DIR_Name[0] == 0x00) // No more entries
+            break;
+        if (!is_live_entry(entry))
+            continue;
+
+        char formatted_name[12];
+        format_dirname(entry->DIR_Name, formatted_name);
+        if (strcasecmp(formatted_name, name) == 0) {
+            *found = *entry;
+            *entry_pos = i;
+            match = true;
+            break;
+        }
+    }
+    free(buffer);
+    return match;
+}
+
+// Stores an entry in the first free slot of a directory, growing the
+// directory by a zeroed cluster if it is full. Only the cluster holding the
+// slot is written.
+bool directory_add_entry(mount_t *m, uint32_t dir_cluster, const dentry_t *new_entry) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint8_t *buffer = malloc(cluster_size);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+
+    uint32_t cluster = dir_cluster, last = 0;
+    while (is_chain_cluster(cluster)) {
+        off_t offset = calculate_cluster_offset(m, cluster);
+        if (!img_read(m, buffer, cluster_size, offset))
+            break;
+        for (uint32_t i = 0; i < cluster_size; i += sizeof(dentry_t)) {
+            dentry_t *entry = (dentry_t *)(buffer + i);
+            if (entry->DIR_Name[0] == 0x00 || (unsigned char)entry->DIR_Name[0] == 0xE5) {
+                memcpy(entry, new_entry, sizeof(dentry_t));
+                bool ok = img_write(m, buffer, cluster_size, offset);
+                free(buffer);
+                return ok;
+            }
+        }
+        last = cluster;
+        cluster = fat_get(m, cluster);
+    }
+
+    // Directory is full: link in a fresh cluster
+    uint32_t added = last != 0 ? allocate_cluster(m) : 0;
+    if (added == 0) {
+        free(buffer);
+        return false;
+    }
+    memset(buffer, 0, cluster_size);
+    memcpy(buffer, new_entry, sizeof(dentry_t));
+    bool ok = img_write(m, buffer, cluster_size, calculate_cluster_offset(m, added));
+    if (ok)
+        fat_set(m, last, added);
+    else
+        fat_set(m, added, 0);
+    free(buffer);
+    return ok;
+}
+
+// Sets an entry's name the way create_file() and create_directory() do
+void set_entry_name(dentry_t *entry, const char *name) {
+    memset(entry->DIR_Name, 0, sizeof(entry->DIR_Name));
+    memcpy(entry->DIR_Name, name, strnlen(name, sizeof(entry->DIR_Name)));
+}
+
+// Finds the entry that names the directory starting at dir_cluster by
+// following its ".." entry and searching the parent. The root has no entry
+// of its own: it comes back as a synthetic entry with *parent_cluster 0.
+bool locate_directory_entry(mount_t *m, uint32_t dir_cluster, dentry_t *entry, uint32_t *parent_cluster, uint32_t *entry_pos) {
+    memset(entry, 0, sizeof(dentry_t));
+    entry->DIR_Name[0] = '/';
+    entry->DIR_Attr = 0x10;
+    set_entry_first_cluster(entry, m->boot.BPB_RootClus);
+    *parent_cluster = 0;
+    *entry_pos = 0;
+    if (dir_cluster == m->boot.BPB_RootClus)
+        return true;
+
+    dentry_t dot_dot;
+    if (!img_read(m, &dot_dot, sizeof(dot_dot), calculate_cluster_offset(m, dir_cluster) + sizeof(dentry_t)))
+        return false;
+    uint32_t parent = entry_first_cluster(&dot_dot);
+    if (!is_chain_cluster(parent))
+        parent = m->boot.BPB_RootClus; // ".." of a top-level directory is 0
+
+    uint32_t size;
+    uint8_t *buffer = read_directory_chain(m, parent, &size);
+    if (buffer == NULL)
+        return false;
+    bool found = false;
+    for (uint32_t i = 0; i < size; i += sizeof(dentry_t)) {
+        dentry_t *candidate = (dentry_t *)(buffer + i);
+        if (candidate->DIR_Name[0] == 0x00) // No more entries
+            break;
+        if (!is_live_entry(candidate) || is_dot_entry(candidate) || !(candidate->DIR_Attr & 0x10))
+            continue;
+        if (entry_first_cluster(candidate) == dir_cluster) {
+            *entry = *candidate;
+            *parent_cluster = parent;
+            *entry_pos = i;
+            found = true;
+            break;
+        }
+    }
+    free(buffer);
+    return found;
+}
+
+// Resolves a path, absolute or relative to the current directory. On success
+// fills *entry and reports where that entry lives (*parent_cluster and
+// *entry_pos), as locate_directory_entry() does for directories.
+bool resolve_path(mount_t *m, const char *path, dentry_t *entry, uint32_t *parent_cluster, uint32_t *entry_pos) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    uint32_t start = path[0] == '/' ? m->boot.BPB_RootClus : m->current_cluster;
+    memset(entry, 0, sizeof(dentry_t));
+    entry->DIR_Attr = 0x10;
+    set_entry_first_cluster(entry, start);
+    bool located = false; // Whether *parent_cluster/*entry_pos describe *entry
+
+    char *save = NULL;
+    for (char *name = strtok_r(buf, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (!(entry->DIR_Attr & 0x10))
+            return false; // A file in the middle of the path
+        uint32_t dir = entry_first_cluster(entry);
+        if (strcmp(name, ".") == 0)
+            continue;
+        if (strcmp(name, "..") == 0) {
+            if (dir == m->boot.BPB_RootClus)
+                continue; // The root is its own parent
+            dentry_t dot_dot;
+            uint32_t pos;
+            if (!find_in_directory(m, dir, "..", &dot_dot, &pos))
+                return false;
+            uint32_t parent = entry_first_cluster(&dot_dot);
+            memset(entry, 0, sizeof(dentry_t));
+            entry->DIR_Attr = 0x10;
+            set_entry_first_cluster(entry, is_chain_cluster(parent) ? parent : m->boot.BPB_RootClus);
+            located = false;
+            continue;
+        }
+
+        dentry_t next;
+        uint32_t pos;
+        if (!find_in_directory(m, dir, name, &next, &pos))
+            return false;
+        *entry = next;
+        *parent_cluster = dir;
+        *entry_pos = pos;
+        located = true;
+    }
+
+    if (!located)
+        return locate_directory_entry(m, entry_first_cluster(entry), entry, parent_cluster, entry_pos);
+    return true;
+}
+
+// Counts the clusters and the contiguous runs (extents) in a chain
+void count_chain_runs(mount_t *m, uint32_t first_cluster, uint32_t *clusters, uint32_t *runs) {
+    *clusters = 0;
+    *runs = 0;
+    uint32_t prev = 0;
+    for (uint32_t c = first_cluster; is_chain_cluster(c) && *clusters < m->fat_cache_entries; c = fat_get(m, c)) {
+        if (*clusters == 0 || c != prev + 1)
+            (*runs)++;
+        (*clusters)++;
+        prev = c;
+    }
+}
+
+// First-fit search for count consecutive free clusters starting below limit.
+// Returns 0 if there is no such run.
+uint32_t find_free_run(mount_t *m, uint32_t count, uint32_t limit) {
+    uint32_t end = data_cluster_limit(m);
+    for (uint32_t start = next_free_cluster(m, 2, end); start < end;) {
+        if (start >= limit)
+            return 0;
+        uint32_t run_length = 1;
+        while (run_length < count && start + run_length < end && cluster_is_free(m, start + run_length))
+            run_length++;
+        if (run_length == count)
+            return start;
+        start = next_free_cluster(m, start + run_length, end);
+    }
+    return 0;
+}
+
+// Allocates a chain of count clusters, as contiguous as free space allows:
+// one free run big enough if there is one, otherwise the free runs in
+// address order. The chain is linked and terminated in the FAT with one
+// write per run. Returns the clusters in chain order (caller frees), or
+// NULL, changing nothing, if there is not enough free space.
+uint32_t *allocate_chain(mount_t *m, uint32_t count) {
+    if (count == 0)
+        return NULL;
+    uint32_t *chain = malloc(count * sizeof(uint32_t));
+    if (chain == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    uint32_t start = find_free_run(m, count, UINT32_MAX);
+    uint32_t have = 0;
+    if (start != 0) {
+        for (; have < count; have++)
+            chain[have] = start + have;
+    } else {
+        uint32_t end = data_cluster_limit(m);
+        for (uint32_t c = next_free_cluster(m, 2, end); c < end && have < count; c = next_free_cluster(m, c + 1, end))
+            chain[have++] = c;
+        if (have < count) {
+            free(chain);
+            return NULL;
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        fat_put(m, chain[i], i + 1 < count ? chain[i + 1] : FAT_EOC);
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run = 1;
+        while (i + run < count && chain[i + run] == chain[i] + run)
+            run++;
+        fat_flush(m, chain[i], run);
+        i += run;
+    }
+    return chain;
+}
+
+// A file or directory found by walking a directory tree
+typedef struct {
+    char path[256];
+    bool is_dir;
+    uint32_t first_cluster;
+    uint32_t clusters;          // Length of the chain, once tree_measure() ran
+    uint32_t runs;              // Number of contiguous extents, likewise
+    int parent;                 // Index of the containing directory, or -1
+    uint32_t entry_dir_cluster; // Containing directory when parent is -1 (0 for the root)
+    uint32_t entry_pos;         // Byte position of the entry in its directory
+    dentry_t entry;             // The entry itself, as found
+} tree_item_t;
+
+typedef struct {
+    tree_item_t *items;
+    int count;
+    int capacity;
+} tree_list_t;
+
+int tree_add(tree_list_t *list, const tree_item_t *item) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        tree_item_t *grown = realloc(list->items, capacity * sizeof(tree_item_t));
+        if (grown == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    list->items[list->count] = *item;
+    return list->count++;
+}
+
+// Adds everything below the directory at index dir_index. Directories are
+// always added before their contents. Returns false, after reporting why, if
+// any part of the tree cannot be listed; callers then must not act on a
+// partial list (rm -r would leak what was left out, cp -r would drop it).
+bool tree_collect(mount_t *m, tree_list_t *list, int dir_index, int depth) {
+    if (depth > TREE_MAX_DEPTH) {
+        command_error(m, "Error: '%s' is nested more than %d directories deep.\n", list->items[dir_index].path, TREE_MAX_DEPTH);
+        return false;
+    }
+
+    uint32_t size;
+    uint8_t *buffer = read_directory_chain(m, list->items[dir_index].first_cluster, &size);
+    if (buffer == NULL) {
+        command_error(m, "Error: cannot read directory '%s'.\n", list->items[dir_index].path);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < size; i += sizeof(dentry_t)) {
+        dentry_t *entry = (dentry_t *)(buffer + i);
+        if (entry->DIR_Name[0] == 0x00) // No more entries
+            break;
+        if (!is_live_entry(entry) || is_dot_entry(entry))
+            continue;
+
+        char formatted_name[12];
+        format_dirname(entry->DIR_Name, formatted_name);
+
+        tree_item_t item;
+        memset(&item, 0, sizeof(item));
+        const char *dir_path = list->items[dir_index].path;
+        size_t dir_len = strlen(dir_path);
+        if (dir_len + strlen(formatted_name) + 2 > sizeof(item.path)) {
+            command_error(m, "Error: path below '%s' is too long.\n", dir_path);
+            free(buffer);
+            return false;
+        }
+        memcpy(item.path, dir_path, dir_len);
+        if (dir_len == 0 || dir_path[dir_len - 1] != '/')
+            item.path[dir_len++] = '/';
+        strcpy(item.path + dir_len, formatted_name);
+        item.is_dir = entry->DIR_Attr & 0x10;
+        item.first_cluster = entry_first_cluster(entry);
+        item.parent = dir_index;
+        item.entry_pos = i;
+        item.entry = *entry;
+
+        int index = tree_add(list, &item);
+        if (index < 0 || (item.is_dir && !tree_collect(m, list, index, depth + 1))) {
+            free(buffer);
+            return false;
+        }
+    }
+    free(buffer);
+    return true;
+}
+
+// Lists everything at and below path; item 0 is path itself. Returns false,
+// after printing an error, if the path does not resolve or the tree cannot
+// be listed in full. Free the list with tree_free().
+bool tree_build(mount_t *m, const char *path, tree_list_t *list) {
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+
+    dentry_t entry;
+    uint32_t parent_cluster, entry_pos;
+    if (!resolve_path(m, path, &entry, &parent_cluster, &entry_pos)) {
+        command_error(m, "Error: '%s' not found.\n", path);
+        return false;
+    }
+
+    tree_item_t root;
+    memset(&root, 0, sizeof(root));
+    snprintf(root.path, sizeof(root.path), "%s", path);
+    root.is_dir = entry.DIR_Attr & 0x10;
+    root.first_cluster = entry_first_cluster(&entry);
+    root.parent = -1;
+    root.entry_dir_cluster = parent_cluster;
+    root.entry_pos = entry_pos;
+    root.entry = entry;
+    if (tree_add(list, &root) < 0)
+        return false;
+    if (root.is_dir)
+        return tree_collect(m, list, 0, 0);
+    return true;
+}
+
+// Fills in clusters and runs for every item. This walks every chain, so
+// only the commands that need the numbers (defrag, cp) pay for it.
+void tree_measure(mount_t *m, tree_list_t *list) {
+    for (int i = 0; i < list->count; i++)
+        count_chain_runs(m, list->items[i].first_cluster, &list->items[i].clusters, &list->items[i].runs);
+}
+
+void tree_free(tree_list_t *list) {
+    free(list->items);
+    list->items = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 8: Defragmentation
+
+#define DEFRAG_COPY_BYTES (4 * 1024 * 1024) // Size of each sequential copy
+#define DEFRAG_WORST_SHOWN 5
+
+// Points the directory entry of an item at a new first cluster
+bool defrag_update_entry(mount_t *m, tree_list_t *list, int index, uint32_t new_cluster) {
+    tree_item_t *item = &list->items[index];
+    uint32_t dir_cluster = item->parent >= 0 ? list->items[item->parent].first_cluster : item->entry_dir_cluster;
+    off_t offset = directory_entry_offset(m, dir_cluster, item->entry_pos);
+    dentry_t entry;
+    if (offset < 0 || !img_read(m, &entry, sizeof(entry), offset))
+        return false;
+    set_entry_first_cluster(&entry, new_cluster);
+    return img_write(m, &entry, sizeof(entry), offset);
+}
+
+// Moves an item's chain to the free run at new_start using large sequential
+// copies, then switches its directory entry over and frees the old chain.
+// The data is copied and the new chain linked before the entry changes, so
+// failing part-way can leak clusters but never loses data.
+bool defrag_relocate(mount_t *m, tree_list_t *list, int index, uint32_t new_start) {
+    tree_item_t *item = &list->items[index];
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t buffer_clusters = DEFRAG_COPY_BYTES / cluster_size;
+    if (buffer_clusters == 0)
+        buffer_clusters = 1;
+
+    uint32_t count;
+    uint32_t *chain = get_cluster_chain(m, item->first_cluster, &count);
+    if (chain == NULL)
+        return false;
+    uint8_t *buffer = malloc((size_t)buffer_clusters * cluster_size);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        free(chain);
+        return false;
+    }
+
+    // Gather source runs into the buffer and write it out in one piece each
+    // time it fills
+    bool ok = true;
+    uint32_t i = 0;
+    while (ok && i < count) {
+        uint32_t dest_index = i;
+        uint32_t filled = 0;
+        while (ok && i < count && filled < buffer_clusters) {
+            uint32_t run = 1;
+            while (i + run < count && filled + run < buffer_clusters && chain[i + run] == chain[i] + run)
+                run++;
+            ok = img_read(m, buffer + (size_t)filled * cluster_size, (size_t)run * cluster_size,
+                          calculate_cluster_offset(m, chain[i]));
+            filled += run;
+            i += run;
+        }
+        if (ok && item->is_dir && dest_index == 0) {
+            // The "." entry points at the directory itself
+            set_entry_first_cluster((dentry_t *)buffer, new_start);
+        }
+        if (ok)
+            ok = img_write(m, buffer, (size_t)filled * cluster_size, calculate_cluster_offset(m, new_start + dest_index));
+    }
+    free(buffer);
+
+    if (ok) {
+        for (uint32_t k = 0; k < count; k++)
+            fat_put(m, new_start + k, k + 1 < count ? new_start + k + 1 : FAT_EOC);
+        fat_flush(m, new_start, count);
+        ok = defrag_update_entry(m, list, index, new_start);
+    }
+    if (!ok) {
+        // Give back the new run; the original chain is untouched
+        for (uint32_t k = 0; k < count; k++)
+            fat_put(m, new_start + k, 0);
+        fat_flush(m, new_start, count);
+        free(chain);
+        return false;
+    }
+
+    if (item->is_dir) {
+        // Subdirectories point back at this one through ".."
+        for (int c = index + 1; c < list->count; c++) {
+            if (list->items[c].parent != index || !list->items[c].is_dir)
+                continue;
+            off_t offset = calculate_cluster_offset(m, list->items[c].first_cluster) + sizeof(dentry_t);
+            dentry_t dot_dot;
+            if (img_read(m, &dot_dot, sizeof(dot_dot), offset)) {
+                set_entry_first_cluster(&dot_dot, new_start);
+                img_write(m, &dot_dot, sizeof(dot_dot), offset);
+            }
+        }
+        if (m->current_cluster == item->first_cluster)
+            m->current_cluster = new_start;
+    }
+
+    // Free the old chain, one FAT write per contiguous run
+    for (uint32_t k = 0; k < count; k++)
+        fat_put(m, chain[k], 0);
+    for (uint32_t k = 0; k < count;) {
+        uint32_t run = 1;
+        while (k + run < count && chain[k + run] == chain[k] + run)
+            run++;
+        fat_flush(m, chain[k], run);
+        k += run;
+    }
+    free(chain);
+
+    item->first_cluster = new_start;
+    item->runs = 1;
+    return true;
+}
+
+void defrag_report(mount_t *m, const tree_list_t *list, const char *title) {
+    uint32_t files = 0, dirs = 0, fragmented = 0, extents = 0;
+    for (int i = 0; i < list->count; i++) {
+        const tree_item_t *item = &list->items[i];
+        if (item->is_dir)
+            dirs++;
+        else
+            files++;
+        extents += item->runs;
+        if (item->runs > 1)
+            fragmented++;
+    }
+    fprintf(m->out, "%s\n", title);
+    fprintf(m->out, "  Files: %u  Directories: %u  Fragmented: %u  Extents: %u\n", files, dirs, fragmented, extents);
+
+    // Worst offenders by number of extents, kept sorted
+    int worst[DEFRAG_WORST_SHOWN];
+    int worst_count = 0;
+    for (int i = 0; i < list->count; i++) {
+        uint32_t runs = list->items[i].runs;
+        if (runs < 2)
+            continue;
+        if (worst_count == DEFRAG_WORST_SHOWN && list->items[worst[worst_count - 1]].runs >= runs)
+            continue;
+        int pos = worst_count < DEFRAG_WORST_SHOWN ? worst_count++ : DEFRAG_WORST_SHOWN - 1;
+        while (pos > 0 && list->items[worst[pos - 1]].runs < runs) {
+            worst[pos] = worst[pos - 1];
+            pos--;
+        }
+        worst[pos] = i;
+    }
+    if (worst_count > 0) {
+        fprintf(m->out, "  Worst offenders:\n");
+        for (int i = 0; i < worst_count; i++) {
+            const tree_item_t *item = &list->items[worst[i]];
+            fprintf(m->out, "    %-30s %6u extents %8u clusters\n", item->path, item->runs, item->clusters);
+        }
+    }
+}
+
+// Progress goes to stderr, and only for an interactive mount; batch runs
+// would just interleave it.
+void defrag_progress(mount_t *m, int done, int total) {
+    if (total > 0 && m->out == stdout)
+        fprintf(stderr, "\rDefragmenting: %d/%d (%d%%)", done, total, done * 100 / total);
+}
+
+// defrag [-d] [path]
+// Reports fragmentation under path (default: the whole volume) and rewrites
+// every fragmented file and directory chain into a contiguous free run.
+// With -d, directories are also moved as close to the front of the data
+// region as free space allows, so directory scans stay near each other.
+void defrag(mount_t *m, char *args) {
+    bool compact_dirs = false;
+    const char *path = "/";
+    char *save = NULL;
+    for (char *arg = strtok_r(args, " ", &save); arg != NULL; arg = strtok_r(NULL, " ", &save)) {
+        if (strcmp(arg, "-d") == 0)
+            compact_dirs = true;
+        else
+            path = arg;
+    }
+
+    pthread_mutex_lock(&m->open_files_lock);
+    int open_count = m->open_files_count;
+    pthread_mutex_unlock(&m->open_files_lock);
+    if (open_count > 0) {
+        command_error(m, "Error: close all open files before defragmenting.\n");
+        return;
+    }
+
+    tree_list_t list;
+    if (!tree_build(m, path, &list)) {
+        tree_free(&list);
+        return;
+    }
+    tree_measure(m, &list);
+
+    char title[300];
+    snprintf(title, sizeof(title), "Fragmentation report for %s:", path);
+    defrag_report(m, &list, title);
+
+    // Work out what to move before moving anything, for the progress count
+    int total = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (list.items[i].runs > 1 || (compact_dirs && list.items[i].is_dir))
+            total++;
+    }
+
+    // Files first, while every directory is still where the list says it is.
+    // Then directories deepest first, so a directory moves before the one
+    // holding its entry.
+    int done = 0, moved_files = 0, moved_dirs = 0, skipped = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int n = 0; n < list.count; n++) {
+            int i = pass == 0 ? n : list.count - 1 - n;
+            tree_item_t *item = &list.items[i];
+            if (item->is_dir != (pass == 1))
+                continue;
+            if (item->runs < 2 && !(compact_dirs && item->is_dir))
+                continue;
+
+            // The root directory is pinned by BPB_RootClus; files or
+            // directories whose entry is in an unknown place stay put too
+            bool pinned = item->first_cluster == m->boot.BPB_RootClus ||
+                          (item->parent < 0 && item->entry_dir_cluster == 0);
+            uint32_t limit = item->runs > 1 ? UINT32_MAX : item->first_cluster;
+            uint32_t new_start = pinned ? 0 : find_free_run(m, item->clusters, limit);
+            if (new_start != 0 && defrag_relocate(m, &list, i, new_start)) {
+                if (item->is_dir)
+                    moved_dirs++;
+                else
+                    moved_files++;
+            } else if (item->runs > 1) {
+                skipped++;
+            }
+            defrag_progress(m, ++done, total);
+        }
+    }
+    if (total > 0 && m->out == stdout)
+        fprintf(stderr, "\n");
+
+    fprintf(m->out, "Relocated %d file(s) and %d directory(ies).\n", moved_files, moved_dirs);
+    if (skipped > 0)
+        fprintf(m->out, "%d chain(s) left fragmented: no contiguous free run large enough.\n", skipped);
+    tree_free(&list);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 9: Creating images (mkfs)
+
+#define MKFS_BYTES_PER_SECTOR 512
+#define MKFS_RESERVED_SECTORS 32
+#define MKFS_NUM_FATS 2
+#define MKFS_BACKUP_BOOT_SECTOR 6
+#define MKFS_MIN_CLUSTERS 65525 // Fewer than this is FAT16 territory
+
+// Parses a size such as 4096, 512K, 64M or 2G
+bool parse_size(const char *text, uint64_t *bytes) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text)
+        return false;
+    switch (*end) {
+        case '\0': break;
+        case 'k': case 'K': value <<= 10; end++; break;
+        case 'm': case 'M': value <<= 20; end++; break;
+        case 'g': case 'G': value <<= 30; end++; break;
+        case 't': case 'T': value <<= 40; end++; break;
+        default: return false;
+    }
+    if (*end != '\0')
+        return false;
+    *bytes = value;
+    return true;
+}
+
+// Default cluster size for a volume, following the Microsoft FAT32 table
+uint32_t mkfs_default_cluster_size(uint64_t size) {
+    if (size <= 260ULL << 20)
+        return 512;
+    if (size <= 8ULL << 30)
+        return 4096;
+    if (size <= 16ULL << 30)
+        return 8192;
+    if (size <= 32ULL << 30)
+        return 16384;
+    return 32768;
+}
+
+// Writes an empty FAT32 volume of the given size to path. The file is sized
+// with ftruncate(), so everything that must be zero (the rest of both FATs,
+// the root directory and the data region) is a sparse hole; only the boot
+// sectors, FSInfo sectors and the first FAT entries are written, with one
+// vectored write per region.
+int make_fat32(const char *path, uint64_t size, uint32_t cluster_bytes, const char *label) {
+    const uint32_t bps = MKFS_BYTES_PER_SECTOR;
+    if (cluster_bytes == 0)
+        cluster_bytes = mkfs_default_cluster_size(size);
+    if (cluster_bytes < bps || cluster_bytes > 32768 || !is_power_of_two(cluster_bytes)) {
+        printf("Error: cluster size must be a power of two from 512 to 32768 bytes.\n");
+        return 1;
+    }
+    uint64_t total_sectors = size / bps;
+    if (total_sectors > UINT32_MAX) {
+        printf("Error: FAT32 volumes are limited to %" PRIu64 " bytes with %u-byte sectors.\n",
+               (uint64_t)UINT32_MAX * bps, bps);
+        return 1;
+    }
+    uint32_t spc = cluster_bytes / bps;
+
+    // FAT size from the formula in the FAT32 specification
+    uint64_t tmp1 = total_sectors - MKFS_RESERVED_SECTORS;
+    uint64_t tmp2 = (256ULL * spc + MKFS_NUM_FATS) / 2;
+    uint32_t fat_sectors = (uint32_t)((tmp1 + tmp2 - 1) / tmp2);
+    uint64_t first_data_sector = MKFS_RESERVED_SECTORS + (uint64_t)MKFS_NUM_FATS * fat_sectors;
+    if (total_sectors <= first_data_sector + spc) {
+        printf("Error: %" PRIu64 " bytes is too small for a FAT32 volume.\n", size);
+        return 1;
+    }
+    uint32_t clusters = (uint32_t)((total_sectors - first_data_sector) / spc);
+    if (clusters < MKFS_MIN_CLUSTERS)
+        printf("Warning: only %u clusters; other tools may not treat this as FAT32.\n", clusters);
+
+    // Boot sector
+    uint8_t boot[MKFS_BYTES_PER_SECTOR];
+    memset(boot, 0, sizeof(boot));
+    bpb_t *bpb = (bpb_t *)boot;
+    memcpy(bpb->BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->BS_OEMName, "MSWIN4.1", 8);
+    bpb->BPB_BytsPerSec = bps;
+    bpb->BPB_SecPerClus = spc;
+    bpb->BPB_RsvdSecCnt = MKFS_RESERVED_SECTORS;
+    bpb->BPB_NumFATs = MKFS_NUM_FATS;
+    bpb->BPB_Media = 0xF8;
+    bpb->BPB_SecPerTrk = 63;
+    bpb->BPB_NumHeads = 255;
+    bpb->BPB_TotSec32 = (uint32_t)total_sectors;
+    bpb->BPB_FATSz32 = fat_sectors;
+    bpb->BPB_RootClus = 2;
+    bpb->BPB_FSInfo = 1;
+    bpb->BPB_BkBootSec = MKFS_BACKUP_BOOT_SECTOR;
+    bpb->BS_DrvNum = 0x80;
+    bpb->BS_BootSig = 0x29;
+    bpb->BS_VolID = (uint32_t)time(NULL);
+    char padded_label[12];
+    snprintf(padded_label, sizeof(padded_label), "%-11.11s", label ? label : "NO NAME");
+    memcpy(bpb->BS_VolLab, padded_label, 11);
+    memcpy(bpb->BS_FilSysType, "FAT32   ", 8);
+    boot[510] = 0x55;
+    boot[511] = 0xAA;
+
+    // FSInfo sector; the root directory takes the first cluster
+    uint8_t fsinfo[MKFS_BYTES_PER_SECTOR];
+    memset(fsinfo, 0, sizeof(fsinfo));
+    uint32_t fsinfo_fields[][2] = {
+        { 0, 0x41615252 },          // FSI_LeadSig
+        { 484, 0x61417272 },        // FSI_StrucSig
+        { 488, clusters - 1 },      // FSI_Free_Count
+        { 492, 3 },                 // FSI_Nxt_Free
+        { 508, 0xAA550000 },        // FSI_TrailSig
+    };
+    for (size_t i = 0; i < sizeof(fsinfo_fields) / sizeof(fsinfo_fields[0]); i++)
+        memcpy(fsinfo + fsinfo_fields[i][0], &fsinfo_fields[i][1], sizeof(uint32_t));
+
+    // First FAT entries: media descriptor, reserved, end of the root chain
+    uint32_t fat_head[3] = { 0x0FFFFF00 | bpb->BPB_Media, FAT_EOC, FAT_EOC };
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("Error creating image");
+        return 1;
+    }
+    if (ftruncate(fd, (off_t)total_sectors * bps) != 0) {
+        perror("Error sizing image");
+        close(fd);
+        return 1;
+    }
+
+    struct iovec boot_region[2] = { { boot, bps }, { fsinfo, bps } };
+    struct iovec fat_region[1] = { { fat_head, sizeof(fat_head) } };
+    struct {
+        const struct iovec *iov;
+        int count;
+        off_t offset;
+    } regions[2 + MKFS_NUM_FATS] = {
+        { boot_region, 2, 0 },
+        { boot_region, 2, (off_t)MKFS_BACKUP_BOOT_SECTOR * bps },
+    };
+    for (int i = 0; i < MKFS_NUM_FATS; i++) {
+        regions[2 + i].iov = fat_region;
+        regions[2 + i].count = 1;
+        regions[2 + i].offset = (off_t)(MKFS_RESERVED_SECTORS + (uint64_t)i * fat_sectors) * bps;
+    }
+    for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++) {
+        ssize_t expected = 0;
+        for (int k = 0; k < regions[i].count; k++)
+            expected += regions[i].iov[k].iov_len;
+        if (pwritev(fd, regions[i].iov, regions[i].count, regions[i].offset) != expected) {
+            perror("Error writing image metadata");
+            close(fd);
+            return 1;
+        }
+    }
+    close(fd);
+
+    printf("Created FAT32 image '%s': %" PRIu64 " bytes, %u-byte clusters, %u clusters, %u sectors per FAT.\n",
+           path, total_sectors * bps, cluster_bytes, clusters, fat_sectors);
+    return 0;
+}
+
+// filesys --mkfs <path> <size> [--cluster N] [--label L]
+int mkfs_main(int argc, char const *argv[]) {
+    uint64_t size;
+    if (argc < 4 || !parse_size(argv[3], &size)) {
+        printf("Usage: filesys --mkfs <path> <size> [--cluster N] [--label L]\n");
+        return 1;
+    }
+    uint64_t cluster_bytes = 0;
+    const char *label = NULL;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--cluster") == 0 && i + 1 < argc && parse_size(argv[i + 1], &cluster_bytes)) {
+            i++;
+        } else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) {
+            label = argv[++i];
+        } else {
+            printf("Usage: filesys --mkfs <path> <size> [--cluster N] [--label L]\n");
+            return 1;
+        }
+    }
+    return make_fat32(argv[2], size, (uint32_t)(cluster_bytes > UINT32_MAX ? 0 : cluster_bytes), label);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 10: Recursive delete
+
+// rm -r <path>
+// Removes a file or a whole directory tree. Only the first cluster of every
+// chain in the subtree is collected; the reclaimer walks the chains and
+// frees them together in sorted batches (see fat_free_clusters()). Only the entry naming the subtree is
+// marked deleted, so its directory is written once and nothing inside the
+// doomed subtree is rewritten.
+void remove_recursive(mount_t *m, char *input) {
+    char path[1024];
+    if (sscanf(input, "%1023s", path) != 1) {
+        command_error(m, "Usage: rm -r <path>\n");
+        return;
+    }
+
+    tree_list_t list;
+    if (!tree_build(m, path, &list)) {
+        tree_free(&list);
+        return;
+    }
+    if (list.items[0].first_cluster == m->boot.BPB_RootClus || list.items[0].entry_dir_cluster == 0) {
+        command_error(m, "Error: cannot remove the root directory.\n");
+        tree_free(&list);
+        return;
+    }
+
+    // Refuse to pull the current directory or an open file out from under us
+    for (int i = 0; i < list.count; i++) {
+        if (list.items[i].is_dir && list.items[i].first_cluster == m->current_cluster) {
+            command_error(m, "Error: '%s' contains the current directory.\n", path);
+            tree_free(&list);
+            return;
+        }
+    }
+    pthread_mutex_lock(&m->open_files_lock);
+    for (int j = 0; j < m->open_files_count; j++) {
+        uint32_t open_cluster = entry_first_cluster(&m->open_files[j].entry);
+        for (int i = 0; i < list.count; i++) {
+            if (!list.items[i].is_dir && list.items[i].first_cluster == open_cluster) {
+                pthread_mutex_unlock(&m->open_files_lock);
+                command_error(m, "Error: '%s' is currently open.\n", list.items[i].path);
+                tree_free(&list);
+                return;
+            }
+        }
+    }
+    pthread_mutex_unlock(&m->open_files_lock);
+
+    // Every chain in the subtree goes to the reclaimer together
+    uint32_t *heads = malloc(list.count * sizeof(uint32_t));
+    if (heads == NULL) {
+        perror("Memory allocation failed");
+        tree_free(&list);
+        return;
+    }
+    int files = 0, dirs = 0;
+    for (int i = 0; i < list.count; i++) {
+        heads[i] = list.items[i].first_cluster;
+        if (list.items[i].is_dir)
+            dirs++;
+        else
+            files++;
+    }
+
+    // Unlink the subtree first: a failure after this leaks clusters rather
+    // than leaving an entry that points at freed ones
+    off_t offset = directory_entry_offset(m, list.items[0].entry_dir_cluster, list.items[0].entry_pos);
+    dentry_t entry;
+    if (offset < 0 || !img_read(m, &entry, sizeof(entry), offset)) {
+        command_error(m, "Error: could not update the directory holding '%s'.\n", path);
+        free(heads);
+        tree_free(&list);
+        return;
+    }
+    entry.DIR_Name[0] = 0xE5; // Mark the entry as deleted
+    img_write(m, &entry, sizeof(entry), offset);
+
+    reclaim_chains(m, heads, list.count);
+    compact_directory_if_sparse(m, list.items[0].entry_dir_cluster);
+
+    fprintf(m->out, "Removed '%s': %d file(s), %d directory(ies); their clusters are freed in the background.\n", path, files, dirs);
+    free(heads);
+    tree_free(&list);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 11: Copy
+
+#define COPY_BUFFER_BYTES (4 * 1024 * 1024)
+
+// Copies bytes within the image, in the kernel where possible
+bool copy_image_range(mount_t *m, off_t from, off_t to, size_t length) {
+    index_note_data(m, to, length);
+    while (m->copy_file_range_works && length > 0) {
+        loff_t in = from, out = to;
+        ssize_t n = copy_file_range(m->img_fd, &in, m->img_fd, &out, length, 0);
+        if (n <= 0) {
+            m->copy_file_range_works = false; // Fall through to the buffered copy
+            break;
+        }
+        from += n;
+        to += n;
+        length -= n;
+    }
+    if (length == 0)
+        return true;
+
+    size_t buffer_size = length < COPY_BUFFER_BYTES ? length : COPY_BUFFER_BYTES;
+    uint8_t *buffer = malloc(buffer_size);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+    bool ok = true;
+    while (ok && length > 0) {
+        size_t chunk = length < buffer_size ? length : buffer_size;
+        ok = img_read(m, buffer, chunk, from) && img_write(m, buffer, chunk, to);
+        from += chunk;
+        to += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    return ok;
+}
+
+// Copies the data of one chain into another of the same length, one
+// stretch at a time where both sides are contiguous
+bool copy_chain_data(mount_t *m, const uint32_t *src, const uint32_t *dst, uint32_t count) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = 1;
+        while (i + run < count && src[i + run] == src[i] + run && dst[i + run] == dst[i] + run)
+            run++;
+        if (!copy_image_range(m, calculate_cluster_offset(m, src[i]), calculate_cluster_offset(m, dst[i]),
+                              (size_t)run * cluster_size))
+            return false;
+        i += run;
+    }
+    return true;
+}
+
+// Writes out a copied directory in one go: ".", "..", then the entries of
+// its copied children pointing at their new chains
+bool copy_write_directory(mount_t *m, tree_list_t *list, int index, uint32_t **new_chains, uint32_t parent_cluster) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    tree_item_t *item = &list->items[index];
+    uint32_t *chain = new_chains[index];
+    uint32_t count = item->clusters;
+    uint8_t *buffer = calloc(count, cluster_size);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+
+    dentry_t *slots = (dentry_t *)buffer;
+    memset(&slots[0], 0, 2 * sizeof(dentry_t));
+    memcpy(slots[0].DIR_Name, ".          ", 11);
+    slots[0].DIR_Attr = 0x10;
+    set_entry_first_cluster(&slots[0], chain[0]);
+    memcpy(slots[1].DIR_Name, "..         ", 11);
+    slots[1].DIR_Attr = 0x10;
+    set_entry_first_cluster(&slots[1], parent_cluster == m->boot.BPB_RootClus ? 0 : parent_cluster);
+
+    uint32_t used = 2;
+    for (int c = index + 1; c < list->count; c++) {
+        if (list->items[c].parent != index)
+            continue;
+        slots[used] = list->items[c].entry;
+        set_entry_first_cluster(&slots[used], new_chains[c] ? new_chains[c][0] : 0);
+        used++;
+    }
+
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count;) {
+        uint32_t run = 1;
+        while (i + run < count && chain[i + run] == chain[i] + run)
+            run++;
+        ok = img_write(m, buffer + (size_t)i * cluster_size, (size_t)run * cluster_size,
+                       calculate_cluster_offset(m, chain[i]));
+        i += run;
+    }
+    free(buffer);
+    return ok;
+}
+
+// cp [-r] <src> <dst>
+// Copies a file, or with -r a directory tree, inside the image. If dst is
+// an existing directory the copy goes inside it under the source's name;
+// otherwise dst names the copy. Every destination chain is allocated up
+// front as contiguous runs, data moves run-to-run with copy_image_range(),
+// and each copied directory is written whole, once.
+void copy_path(mount_t *m, char *input, bool recursive) {
+    char src[1024], dst[1024];
+    if (sscanf(input, "%1023s %1023s", src, dst) != 2) {
+        command_error(m, "Usage: cp [-r] <src> <dst>\n");
+        return;
+    }
+
+    tree_list_t list;
+    if (!tree_build(m, src, &list)) {
+        tree_free(&list);
+        return;
+    }
+    if (list.items[0].is_dir && !recursive) {
+        command_error(m, "Error: '%s' is a directory (use cp -r).\n", src);
+        tree_free(&list);
+        return;
+    }
+    tree_measure(m, &list);
+
+    // Work out the destination directory and the name of the copy
+    char name[12];
+    uint32_t dest_dir;
+    dentry_t dest_entry;
+    uint32_t dest_parent, dest_pos;
+    if (resolve_path(m, dst, &dest_entry, &dest_parent, &dest_pos) && (dest_entry.DIR_Attr & 0x10)) {
+        dest_dir = entry_first_cluster(&dest_entry);
+        if (list.items[0].entry_dir_cluster == 0) {
+            command_error(m, "Error: name the copy of the root directory explicitly.\n");
+            tree_free(&list);
+            return;
+        }
+        format_dirname(list.items[0].entry.DIR_Name, name);
+    } else {
+        char parent_path[1024];
+        snprintf(parent_path, sizeof(parent_path), "%s", dst);
+        char *slash = strrchr(parent_path, '/');
+        const char *base = dst;
+        if (slash != NULL) {
+            base = dst + (slash - parent_path) + 1;
+            if (slash == parent_path)
+                slash[1] = '\0';
+            else
+                *slash = '\0';
+        } else {
+            strcpy(parent_path, ".");
+        }
+        if (!resolve_path(m, parent_path, &dest_entry, &dest_parent, &dest_pos) || !(dest_entry.DIR_Attr & 0x10)) {
+            command_error(m, "Error: directory '%s' not found.\n", parent_path);
+            tree_free(&list);
+            return;
+        }
+        if (base[0] == '\0' || strlen(base) > 11) {
+            command_error(m, "Error: invalid name '%s'.\n", base);
+            tree_free(&list);
+            return;
+        }
+        dest_dir = entry_first_cluster(&dest_entry);
+        memcpy(name, base, strlen(base) + 1);
+    }
+    dentry_t existing;
+    uint32_t existing_pos;
+    if (find_in_directory(m, dest_dir, name, &existing, &existing_pos)) {
+        command_error(m, "Error: '%s' already exists.\n", name);
+        tree_free(&list);
+        return;
+    }
+
+    // Directories are rebuilt rather than copied, sized to their live entries
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t entries_per_cluster = cluster_size / sizeof(dentry_t);
+    uint32_t *source_clusters = malloc(list.count * sizeof(uint32_t));
+    uint32_t **new_chains = calloc(list.count, sizeof(uint32_t *));
+    if (source_clusters == NULL || new_chains == NULL) {
+        perror("Memory allocation failed");
+        free(source_clusters);
+        free(new_chains);
+        tree_free(&list);
+        return;
+    }
+    for (int i = 0; i < list.count; i++) {
+        source_clusters[i] = list.items[i].clusters;
+        if (list.items[i].is_dir) {
+            uint32_t entries = 2;
+            for (int c = i + 1; c < list.count; c++)
+                entries += list.items[c].parent == i;
+            list.items[i].clusters = (entries + entries_per_cluster - 1) / entries_per_cluster;
+        }
+    }
+
+    bool ok = true;
+    for (int i = 0; ok && i < list.count; i++) {
+        if (list.items[i].clusters == 0)
+            continue; // Empty file without a chain
+        new_chains[i] = allocate_chain(m, list.items[i].clusters);
+        if (new_chains[i] == NULL) {
+            command_error(m, "Error: not enough free space to copy '%s'.\n", src);
+            ok = false;
+        }
+    }
+
+    int files = 0, dirs = 0;
+    for (int i = 0; ok && i < list.count; i++) {
+        tree_item_t *item = &list.items[i];
+        if (item->is_dir) {
+            uint32_t parent = item->parent >= 0 ? new_chains[item->parent][0] : dest_dir;
+            ok = copy_write_directory(m, &list, i, new_chains, parent);
+            dirs++;
+        } else if (new_chains[i] != NULL) {
+            uint32_t count;
+            uint32_t *chain = get_cluster_chain(m, item->first_cluster, &count);
+            ok = chain != NULL && count == source_clusters[i] && copy_chain_data(m, chain, new_chains[i], count);
+            free(chain);
+            files++;
+        } else {
+            files++;
+        }
+    }
+
+    if (ok) {
+        // Publish the copy last so a failure never leaves a half-made entry
+        dentry_t top = list.items[0].entry;
+        if (list.items[0].entry_dir_cluster == 0) {
+            memset(&top, 0, sizeof(top));
+            top.DIR_Attr = 0x10;
+        }
+        set_entry_name(&top, name);
+        set_entry_first_cluster(&top, new_chains[0] ? new_chains[0][0] : 0);
+        ok = directory_add_entry(m, dest_dir, &top);
+        if (!ok)
+            command_error(m, "Error: could not add '%s' to its directory.\n", name);
+    }
+
+    if (ok) {
+        fprintf(m->out, "Copied '%s' to '%s': %d file(s), %d directory(ies).\n", src, dst, files, dirs);
+    } else {
+        // Hand back everything allocated for the copy
+        for (int i = 0; i < list.count; i++) {
+            if (new_chains[i] != NULL)
+                fat_free_clusters(m, new_chains[i], list.items[i].clusters);
+        }
+    }
+    for (int i = 0; i < list.count; i++)
+        free(new_chains[i]);
+    free(new_chains);
+    free(source_clusters);
+    tree_free(&list);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 12: Truncate
+
+#define TRUNCATE_ZERO_BYTES (64 * 1024)
+
+// truncate <file> <size>
+// Shrinking keeps the clusters that still hold data (at least one, as
+// create_file() does), ends the chain there and hands the cut-off tail to
+// the background reclaimer. Growing extends the chain and zero-fills the
+// new bytes. Either way DIR_FileSize is written back to the directory.
+void truncate_file(mount_t *m, char *input) {
+    char path[1024], size_text[32];
+    uint64_t new_size;
+    if (sscanf(input, "%1023s %31s", path, size_text) != 2 || !parse_size(size_text, &new_size)) {
+        command_error(m, "Usage: truncate <file> <size>\n");
+        return;
+    }
+    if (new_size > UINT32_MAX) {
+        command_error(m, "Error: FAT32 files are limited to %u bytes.\n", UINT32_MAX);
+        return;
+    }
+
+    dentry_t entry;
+    uint32_t parent_cluster, entry_pos;
+    if (!resolve_path(m, path, &entry, &parent_cluster, &entry_pos)) {
+        command_error(m, "Error: File '%s' not found.\n", path);
+        return;
+    }
+    if (entry.DIR_Attr & 0x10) {
+        command_error(m, "Error: '%s' is a directory.\n", path);
+        return;
+    }
+    off_t entry_offset = directory_entry_offset(m, parent_cluster, entry_pos);
+    if (entry_offset < 0) {
+        command_error(m, "Error: could not locate the entry for '%s'.\n", path);
+        return;
+    }
+
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint32_t old_size = entry.DIR_FileSize;
+    uint32_t old_first = entry_first_cluster(&entry);
+
+    if (new_size < old_size) {
+        uint32_t keep = (uint32_t)((new_size + cluster_size - 1) / cluster_size);
+        if (keep == 0)
+            keep = 1;
+        uint32_t last = old_first;
+        for (uint32_t i = 1; i < keep && is_chain_cluster(last); i++)
+            last = fat_get(m, last);
+        if (is_chain_cluster(last)) {
+            uint32_t tail = fat_get(m, last);
+            if (is_chain_cluster(tail)) {
+                fat_set(m, last, FAT_EOC);
+                reclaim_chain(m, tail);
+            }
+        }
+        entry.DIR_FileSize = (uint32_t)new_size;
+    } else if (new_size > old_size) {
+        extend_file(m, &entry, (uint32_t)new_size);
+        if (entry.DIR_FileSize != new_size)
+            return; // extend_file() reported the error
+
+        uint8_t *zeros = calloc(1, TRUNCATE_ZERO_BYTES);
+        if (zeros == NULL) {
+            perror("Memory allocation failed");
+            return;
+        }
+        for (uint32_t pos = old_size; pos < new_size;) {
+            uint32_t chunk = (uint32_t)(new_size - pos) < TRUNCATE_ZERO_BYTES ? (uint32_t)(new_size - pos) : TRUNCATE_ZERO_BYTES;
+            if (transfer_file_data(m, &entry, zeros, chunk, pos, true) != chunk)
+                break;
+            pos += chunk;
+        }
+        free(zeros);
+    }
+    img_write(m, &entry, sizeof(entry), entry_offset);
+
+    // Keep handles on this file in step. Match on where the entry lives:
+    // every empty file shares first cluster 0.
+    pthread_mutex_lock(&m->open_files_lock);
+    for (int i = 0; i < m->open_files_count; i++) {
+        if (m->open_files[i].dir_cluster != parent_cluster || m->open_files[i].entry_pos != entry_pos)
+            continue;
+        m->open_files[i].entry = entry;
+        if (m->open_files[i].wb != NULL)
+            write_behind_forget(m->open_files[i].wb);
+        if (m->open_files[i].file_pos > entry.DIR_FileSize)
+            m->open_files[i].file_pos = entry.DIR_FileSize;
+        readahead_drop(m->open_files[i].ra, m->open_files[i].file_pos, &entry);
+    }
+    pthread_mutex_unlock(&m->open_files_lock);
+
+    fprintf(m->out, "File '%s' truncated to %u bytes.\n", path, entry.DIR_FileSize);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 13: Checksums
+
+// Whole-file content passes (sum, dupes, grep) stream each file through a
+// consumer callback. Contiguous clusters are fetched with one pread, up to
+// CONTENT_BATCH_BYTES at a time, and files are spread over a thread pool
+// with one worker per core. The caller holds fs_lock shared for the whole
+// pass, so nothing changes underneath the workers; their fat_get() calls
+// share the FAT pager's lock unless a window has to be paged in.
+#define CONTENT_BATCH_BYTES (4 * 1024 * 1024)
+
+typedef bool (*content_fn)(void *ctx, const uint8_t *data, size_t len);
+
+// Feeds a file's bytes to consume, in order. Returns false if a read fails,
+// the chain is shorter than the file, or consume asks to stop.
+bool stream_file_data(mount_t *m, const dentry_t *entry, content_fn consume, void *ctx) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    uint64_t left = entry->DIR_FileSize; // Bytes not read yet
+    if (left == 0)
+        return true;
+
+    // Batches are whole clusters, so every run starts on a cluster boundary
+    size_t capacity = CONTENT_BATCH_BYTES;
+    if ((left + cluster_size - 1) / cluster_size * cluster_size < capacity)
+        capacity = (left + cluster_size - 1) / cluster_size * cluster_size;
+    uint8_t *buffer = malloc(capacity);
+    if (buffer == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t cluster = entry_first_cluster(entry);
+    while (ok && left > 0) {
+        size_t filled = 0;
+        while (ok && filled < capacity && filled < left && is_chain_cluster(cluster)) {
+            uint32_t start = cluster, run = 1;
+            cluster = fat_get(m, cluster);
+            while (cluster == start + run && (size_t)(run + 1) * cluster_size <= capacity - filled &&
+                   (uint64_t)run * cluster_size < left - filled) {
+                run++;
+                cluster = fat_get(m, cluster);
+            }
+            size_t bytes = (size_t)run * cluster_size;
+            if (bytes > left - filled)
+                bytes = left - filled;
+            ok = img_read(m, buffer + filled, bytes, calculate_cluster_offset(m, start));
+            filled += bytes;
+        }
+        if (!ok || filled == 0)
+            ok = false; // Read error, or the chain ended before the file did
+        else {
+            left -= filled;
+            ok = consume(ctx, buffer, filled);
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+// Runs fn on each of count jobs (item_size bytes apart) on a pool with the
+// mount's parallel_threads threads, and waits for all of them. --each lowers
+// that so images running side by side share the cores instead of every
+// image starting a pool of its own as large as the machine.
+void run_parallel(mount_t *m, void (*fn)(void *), void *jobs, size_t item_size, int count) {
+    long cores = m->options.parallel_threads > 0 ? m->options.parallel_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores > 1 ? (int)cores : 0; // No threads: run inline
+    if (threads > count)
+        threads = count;
+    thread_pool_t pool;
+    pool_init(&pool, threads);
+    for (int i = 0; i < count; i++)
+        pool_submit(&pool, fn, (uint8_t *)jobs + (size_t)i * item_size);
+    pool_wait(&pool);
+    pool_destroy(&pool);
+}
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it, otherwise a slice-by-8 table.
+#define CRC32C_POLY 0x82F63B78
+
+uint32_t crc32c_table[8][256];
+bool crc32c_hw = false;
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+void crc32c_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xFF];
+    }
+#if defined(__x86_64__) && defined(__GNUC__)
+    crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc; // Little-endian, like every host this runs on
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+        len--;
+    }
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len-- > 0)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#endif
+
+// Continues a CRC32C over more data; start with crc = 0
+uint32_t crc32c(uint32_t crc, const void *data, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (crc32c_hw)
+        return ~crc32c_sse42(crc, data, len);
+#endif
+    return ~crc32c_sw(crc, data, len);
+}
+
+// SHA-256 (FIPS 180-4)
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;     // Bytes hashed so far
+    uint8_t block[64];
+    size_t fill;
+} sha256_t;
+
+const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256_init(sha256_t *ctx) {
+    const uint32_t initial[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                  0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+void sha256_block(sha256_t *ctx, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 |
+               (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256_update(sha256_t *ctx, const void *data, size_t len) {
+    const uint8_t *p = data;
+    ctx->length += len;
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        len -= take;
+        if (ctx->fill < 64)
+            return;
+        sha256_block(ctx, ctx->block);
+        ctx->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+        sha256_block(ctx, p);
+    memcpy(ctx->block, p, len);
+    ctx->fill = len;
+}
+
+void sha256_final(sha256_t *ctx, uint8_t digest[32]) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len = (ctx->fill < 56 ? 56 : 120) - ctx->fill;
+    for (int i = 0; i < 8; i++)
+        pad[pad_len + i] = (uint8_t)(bits >> (56 - i * 8));
+    sha256_update(ctx, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)ctx->state[i];
+    }
+}
+
+// One file to checksum
+typedef struct {
+    mount_t *m;
+    const tree_item_t *item;
+    bool want_sha256;
+    bool ok;
+    uint32_t crc;
+    uint8_t sha256[32];
+    sha256_t sha_ctx;
+} sum_job_t;
+
+bool sum_consume(void *ctx, const uint8_t *data, size_t len) {
+    sum_job_t *job = ctx;
+    job->crc = crc32c(job->crc, data, len);
+    if (job->want_sha256)
+        sha256_update(&job->sha_ctx, data, len);
+    return true;
+}
+
+void sum_file_job(void *arg) {
+    sum_job_t *job = arg;
+    job->crc = 0;
+    if (job->want_sha256)
+        sha256_init(&job->sha_ctx);
+    job->ok = stream_file_data(job->m, &job->item->entry, sum_consume, job);
+    if (job->want_sha256)
+        sha256_final(&job->sha_ctx, job->sha256);
+}
+
+// Checksums the given files in parallel. Returns the jobs, in the same
+// order, or NULL if out of memory. Caller frees.
+sum_job_t *sum_files(mount_t *m, const tree_item_t **items, int count, bool want_sha256) {
+    sum_job_t *jobs = calloc(count ? count : 1, sizeof(sum_job_t));
+    if (jobs == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        jobs[i].m = m;
+        jobs[i].item = items[i];
+        jobs[i].want_sha256 = want_sha256;
+    }
+    run_parallel(m, sum_file_job, jobs, sizeof(sum_job_t), count);
+    return jobs;
+}
+
+void format_sha256(const uint8_t digest[32], char hex[65]) {
+    for (int i = 0; i < 32; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+// sum [-r] [-s] <path>
+// Prints the CRC32C (and with -s the SHA-256), size and path of a file, or
+// with -r of every file under a directory.
+void sum_command(mount_t *m, char *args) {
+    bool recursive = false, want_sha256 = false;
+    const char *path = NULL;
+    char *save = NULL;
+    for (char *arg = strtok_r(args, " ", &save); arg != NULL; arg = strtok_r(NULL, " ", &save)) {
+        if (strcmp(arg, "-r") == 0)
+            recursive = true;
+        else if (strcmp(arg, "-s") == 0)
+            want_sha256 = true;
+        else
+            path = arg;
+    }
+    if (path == NULL) {
+        command_error(m, "Usage: sum [-r] [-s] <path>\n");
+        return;
+    }
+
+    tree_list_t list;
+    if (!tree_build(m, path, &list)) {
+        tree_free(&list);
+        return;
+    }
+    if (list.items[0].is_dir && !recursive) {
+        command_error(m, "Error: '%s' is a directory (use sum -r).\n", path);
+        tree_free(&list);
+        return;
+    }
+
+    const tree_item_t **files = malloc(list.count * sizeof(tree_item_t *));
+    int file_count = 0;
+    for (int i = 0; files != NULL && i < list.count; i++) {
+        if (!list.items[i].is_dir)
+            files[file_count++] = &list.items[i];
+    }
+    sum_job_t *jobs = files ? sum_files(m, files, file_count, want_sha256) : NULL;
+    if (jobs == NULL) {
+        free(files);
+        tree_free(&list);
+        return;
+    }
+
+    uint64_t total_bytes = 0;
+    int failed = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (!jobs[i].ok) {
+            command_error(m, "Error: could not read '%s'.\n", files[i]->path);
+            failed++;
+            continue;
+        }
+        total_bytes += files[i]->entry.DIR_FileSize;
+        if (want_sha256) {
+            char hex[65];
+            format_sha256(jobs[i].sha256, hex);
+            fprintf(m->out, "%08x  %s  %10u  %s\n", jobs[i].crc, hex, files[i]->entry.DIR_FileSize, files[i]->path);
+        } else {
+            fprintf(m->out, "%08x  %10u  %s\n", jobs[i].crc, files[i]->entry.DIR_FileSize, files[i]->path);
+        }
+    }
+    if (recursive)
+        fprintf(m->out, "Checksummed %d file(s), %" PRIu64 " byte(s)%s.\n", file_count - failed, total_bytes,
+                failed > 0 ? ", some files could not be read" : "");
+
+    free(jobs);
+    free(files);
+    tree_free(&list);
+}
+
+int compare_by_size(const void *a, const void *b) {
+    uint32_t x = (*(const tree_item_t *const *)a)->entry.DIR_FileSize;
+    uint32_t y = (*(const tree_item_t *const *)b)->entry.DIR_FileSize;
+    return x < y ? -1 : x > y;
+}
+
+int compare_sum_jobs(const void *a, const void *b) {
+    const sum_job_t *x = a, *y = b;
+    if (x->item->entry.DIR_FileSize != y->item->entry.DIR_FileSize)
+        return x->item->entry.DIR_FileSize < y->item->entry.DIR_FileSize ? -1 : 1;
+    if (x->ok != y->ok)
+        return x->ok ? -1 : 1;
+    int order = memcmp(x->sha256, y->sha256, sizeof(x->sha256));
+    if (order == 0 && x->crc != y->crc)
+        order = x->crc < y->crc ? -1 : 1;
+    return order != 0 ? order : strcmp(x->item->path, y->item->path);
+}
+
+bool same_contents(const sum_job_t *a, const sum_job_t *b) {
+    return a->ok && b->ok && a->item->entry.DIR_FileSize == b->item->entry.DIR_FileSize &&
+           a->crc == b->crc && memcmp(a->sha256, b->sha256, sizeof(a->sha256)) == 0;
+}
+
+// dupes [path]
+// Reports sets of identical files under path (default: the whole volume).
+// Files are grouped by size first; only files that share a size are read
+// and hashed (CRC32C and SHA-256), and identical hashes form a set.
+void dupes_command(mount_t *m, char *args) {
+    char *save = NULL;
+    char *arg = strtok_r(args, " ", &save);
+    const char *path = arg != NULL ? arg : "/";
+
+    tree_list_t list;
+    if (!tree_build(m, path, &list)) {
+        tree_free(&list);
+        return;
+    }
+
+    const tree_item_t **files = malloc(list.count * sizeof(tree_item_t *));
+    if (files == NULL) {
+        perror("Memory allocation failed");
+        tree_free(&list);
+        return;
+    }
+    int file_count = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (!list.items[i].is_dir && list.items[i].entry.DIR_FileSize > 0)
+            files[file_count++] = &list.items[i];
+    }
+    qsort(files, file_count, sizeof(tree_item_t *), compare_by_size);
+
+    // Keep only files whose size is shared with another file
+    int candidates = 0;
+    for (int i = 0; i < file_count; i++) {
+        uint32_t size = files[i]->entry.DIR_FileSize;
+        bool shared = (i > 0 && files[i - 1]->entry.DIR_FileSize == size) ||
+                      (i + 1 < file_count && files[i + 1]->entry.DIR_FileSize == size);
+        if (shared)
+            files[candidates++] = files[i];
+    }
+
+    sum_job_t *jobs = sum_files(m, files, candidates, true);
+    if (jobs == NULL) {
+        free(files);
+        tree_free(&list);
+        return;
+    }
+    qsort(jobs, candidates, sizeof(sum_job_t), compare_sum_jobs);
+
+    int sets = 0, redundant = 0, unreadable = 0;
+    uint64_t reclaimable = 0;
+    for (int i = 0; i < candidates;) {
+        if (!jobs[i].ok) {
+            command_error(m, "Error: could not read '%s'.\n", jobs[i].item->path);
+            unreadable++;
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < candidates && same_contents(&jobs[i], &jobs[j]))
+            j++;
+        if (j - i > 1) {
+            char hex[65];
+            format_sha256(jobs[i].sha256, hex);
+            sets++;
+            fprintf(m->out, "Duplicate set %d: %d file(s) of %u byte(s), sha256 %s\n", sets, j - i,
+                    jobs[i].item->entry.DIR_FileSize, hex);
+            for (int k = i; k < j; k++)
+                fprintf(m->out, "    %s\n", jobs[k].item->path);
+            redundant += j - i - 1;
+            reclaimable += (uint64_t)(j - i - 1) * jobs[i].item->entry.DIR_FileSize;
+        }
+        i = j;
+    }
+    fprintf(m->out, "Scanned %d file(s), hashed %d with a shared size: %d duplicate set(s), "
+            "%d redundant file(s), %" PRIu64 " byte(s) reclaimable.\n",
+            file_count, candidates - unreadable, sets, redundant, reclaimable);
+
+    free(jobs);
+    free(files);
+    tree_free(&list);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 14: Content search
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define GREP_MAX_PATTERN 255
+
+// Finds the first occurrence of pattern (len >= 1) in data. Candidates are
+// positions where both the first and the last byte of the pattern match;
+// with SSE2 those are found 16 positions at a time and only candidates are
+// compared in full.
+const uint8_t *find_pattern(const uint8_t *data, size_t size, const uint8_t *pattern, size_t len) {
+    if (len == 0 || size < len)
+        return NULL;
+    size_t last = size - len; // Last position a match can start at
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8((char)pattern[0]);
+    const __m128i final = _mm_set1_epi8((char)pattern[len - 1]);
+    for (; i + 16 <= last + 1; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(data + i + len - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, final)));
+        while (mask != 0) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(data + i + bit + 1, pattern + 1, len > 2 ? len - 2 : 0) == 0)
+                return data + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i <= last) {
+        const uint8_t *hit = memchr(data + i, pattern[0], last - i + 1);
+        if (hit == NULL)
+            return NULL;
+        if (memcmp(hit, pattern, len) == 0)
+            return hit;
+        i = (size_t)(hit - data) + 1;
+    }
+    return NULL;
+}
+
+// One file to search. Matches that straddle two batches are found by
+// scanning the last len - 1 bytes of one batch joined to the first len - 1
+// bytes of the next.
+typedef struct {
+    mount_t *m;
+    const tree_item_t *item;
+    const uint8_t *pattern;
+    size_t len;
+    bool names_only;       // -l: stop at the first match
+    bool ok;
+    uint64_t scanned;      // File offset of the start of the next batch
+    uint8_t carry[GREP_MAX_PATTERN];
+    size_t carry_len;
+    uint32_t *hits;        // Match offsets, ascending
+    uint32_t hit_count;
+    uint32_t hit_capacity;
+} grep_job_t;
+
+bool grep_add_hit(grep_job_t *job, uint64_t offset) {
+    if (job->hit_count == job->hit_capacity) {
+        uint32_t capacity = job->hit_capacity ? job->hit_capacity * 2 : 16;
+        uint32_t *grown = realloc(job->hits, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+            return false;
+        job->hits = grown;
+        job->hit_capacity = capacity;
+    }
+    job->hits[job->hit_count++] = (uint32_t)offset;
+    return !job->names_only;
+}
+
+bool grep_consume(void *ctx, const uint8_t *data, size_t size) {
+    grep_job_t *job = ctx;
+    size_t len = job->len;
+
+    // Matches that start in the carried tail of the previous batch
+    if (job->carry_len > 0) {
+        uint8_t joint[2 * GREP_MAX_PATTERN];
+        size_t head = size < len - 1 ? size : len - 1;
+        memcpy(joint, job->carry, job->carry_len);
+        memcpy(joint + job->carry_len, data, head);
+        uint64_t base = job->scanned - job->carry_len;
+        const uint8_t *p = joint;
+        size_t joint_len = job->carry_len + head;
+        while ((p = find_pattern(p, joint + joint_len - p, job->pattern, len)) != NULL &&
+               (size_t)(p - joint) < job->carry_len) {
+            if (!grep_add_hit(job, base + (p - joint)))
+                return false;
+            p++;
+        }
+    }
+
+    const uint8_t *p = data;
+    while ((p = find_pattern(p, data + size - p, job->pattern, len)) != NULL) {
+        if (!grep_add_hit(job, job->scanned + (p - data)))
+            return false;
+        p++;
+    }
+
+    // Keep the tail that could begin a match finishing in the next batch
+    size_t keep = len - 1;
+    if (size >= keep) {
+        memcpy(job->carry, data + size - keep, keep);
+        job->carry_len = keep;
+    } else {
+        size_t old = job->carry_len + size > keep ? job->carry_len + size - keep : 0;
+        memmove(job->carry, job->carry + old, job->carry_len - old);
+        memcpy(job->carry + job->carry_len - old, data, size);
+        job->carry_len = job->carry_len - old + size;
+    }
+    job->scanned += size;
+    return true;
+}
+
+void grep_file_job(void *arg) {
+    grep_job_t *job = arg;
+    bool finished = stream_file_data(job->m, &job->item->entry, grep_consume, job);
+    // With -l the scan stops early on purpose once a match is found
+    job->ok = finished || (job->names_only && job->hit_count > 0);
+}
+
+// Splits the next argument off args, honouring "double quotes"
+char *next_argument(char **args) {
+    char *p = *args;
+    while (*p == ' ')
+        p++;
+    if (*p == '\0')
+        return NULL;
+    char *start = p;
+    if (*p == '"') {
+        start = ++p;
+        while (*p != '\0' && *p != '"')
+            p++;
+    } else {
+        while (*p != '\0' && *p != ' ')
+            p++;
+    }
+    if (*p != '\0')
+        *p++ = '\0';
+    *args = p;
+    return start;
+}
+
+// grep [-r] [-l] <pattern> <path>
+// Prints path:offset for every occurrence of a literal pattern in a file,
+// or with -r in every file under a directory. With -l only the names of
+// files that contain it are printed.
+void grep_command(mount_t *m, char *args) {
+    bool recursive = false, names_only = false;
+    const char *pattern = NULL, *path = NULL;
+    for (char *arg = next_argument(&args); arg != NULL; arg = next_argument(&args)) {
+        if (pattern == NULL && strcmp(arg, "-r") == 0)
+            recursive = true;
+        else if (pattern == NULL && strcmp(arg, "-l") == 0)
+            names_only = true;
+        else if (pattern == NULL)
+            pattern = arg;
+        else
+            path = arg;
+    }
+    if (pattern == NULL || path == NULL || pattern[0] == '\0') {
+        command_error(m, "Usage: grep [-r] [-l] <pattern> <path>\n");
+        return;
+    }
+    size_t len = strlen(pattern);
+    if (len > GREP_MAX_PATTERN) {
+        command_error(m, "Error: pattern is longer than %d bytes.\n", GREP_MAX_PATTERN);
+        return;
+    }
+
+    tree_list_t list;
+    if (!tree_build(m, path, &list)) {
+        tree_free(&list);
+        return;
+    }
+    if (list.items[0].is_dir && !recursive) {
+        command_error(m, "Error: '%s' is a directory (use grep -r).\n", path);
+        tree_free(&list);
+        return;
+    }
+
+    grep_job_t *jobs = calloc(list.count, sizeof(grep_job_t));
+    if (jobs == NULL) {
+        perror("Memory allocation failed");
+        tree_free(&list);
+        return;
+    }
+    int file_count = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (list.items[i].is_dir || list.items[i].entry.DIR_FileSize < len)
+            continue;
+        grep_job_t *job = &jobs[file_count++];
+        job->m = m;
+        job->item = &list.items[i];
+        job->pattern = (const uint8_t *)pattern;
+        job->len = len;
+        job->names_only = names_only;
+    }
+    run_parallel(m, grep_file_job, jobs, sizeof(grep_job_t), file_count);
+
+    uint64_t total_hits = 0;
+    int matching_files = 0;
+    for (int i = 0; i < file_count; i++) {
+        grep_job_t *job = &jobs[i];
+        if (!job->ok)
+            command_error(m, "Error: could not read '%s'.\n", job->item->path);
+        if (job->hit_count > 0) {
+            matching_files++;
+            total_hits += job->hit_count;
+            if (names_only)
+                fprintf(m->out, "%s\n", job->item->path);
+            else {
+                for (uint32_t h = 0; h < job->hit_count; h++)
+                    fprintf(m->out, "%s:%u\n", job->item->path, job->hits[h]);
+            }
+        }
+        free(job->hits);
+    }
+    if (matching_files == 0)
+        fprintf(m->out, "No matches for '%s'.\n", pattern);
+    else if (recursive && !names_only)
+        fprintf(m->out, "%" PRIu64 " match(es) in %d file(s).\n", total_hits, matching_files);
+
+    free(jobs);
+    tree_free(&list);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 15: Mount index
+
+// With --index, a sidecar file .<image>.idx next to each image holds the
+// free-cluster bitmap, the FAT as run-length extents (each file's extent
+// list is the chain of extents its first cluster starts), and every
+// directory's entries. At mount the file is mapped with mmap and
+// trusted if its generation stamp still matches: the image's size and mtime
+// when it was saved, plus checksums of the FSInfo sector and the head of
+// the FAT, all of which cost a couple of small reads. --verify-index also
+// checks every group of FAT entries against the checksum it was saved
+// with. Chains and free space then come from the index until something
+// changes the FAT. A stale index is rebuilt from the image at mount,
+// reusing every group of FAT entries and every directory whose checksum has
+// not changed, and saved again. After changes it is rebuilt and saved at
+// unmount, reading only the groups of FAT entries the session changed and
+// the directories whose clusters it wrote.
+#define INDEX_MAGIC "FATIDX1"
+#define INDEX_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_crc;       // CRC32C of the header with this field zero
+    uint64_t image_size;       // Generation stamp
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    bpb_t boot;                // Must match the image's boot sector
+    uint8_t pad[6];
+    uint32_t cluster_limit;
+    uint32_t free_count;
+    uint32_t fsinfo_crc;       // CRC32C of the FSInfo sector
+    uint32_t head_crc;         // CRC32C of the first group of FAT entries
+    uint32_t group_count;
+    uint32_t extent_count;
+    uint32_t dir_count;
+    uint32_t entry_count;
+    uint64_t group_offset;
+    uint64_t bitmap_offset;
+    uint64_t extent_offset;
+    uint64_t dir_offset;
+    uint64_t entry_offset;
+    uint64_t file_size;
+} index_header_t;
+
+uint32_t index_bitmap_words(uint32_t cluster_limit) {
+    return (cluster_limit + 63) / 64;
+}
+
+void index_release(mount_index_t *ix) {
+    if (ix->map != NULL) {
+        munmap(ix->map, ix->map_size);
+    } else {
+        free(ix->group_crc);
+        free(ix->bitmap);
+        free(ix->extents);
+        free(ix->dirs);
+        free(ix->entries);
+    }
+    ix->map = NULL;
+    ix->group_crc = NULL;
+    ix->bitmap = NULL;
+    ix->extents = NULL;
+    ix->dirs = NULL;
+    ix->entries = NULL;
+}
+
+// True if a section of count items of the given size fits in the file
+bool index_section_fits(const index_header_t *header, uint64_t offset, uint64_t count, size_t size) {
+    return offset % 8 == 0 && offset <= header->file_size && count * size <= header->file_size - offset;
+}
+
+// Maps the sidecar file and checks that it is a well-formed index for this
+// volume. Does not look at the generation stamp.
+bool index_map(mount_t *m, mount_index_t *ix) {
+    int fd = open(ix->path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(index_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    index_header_t *header = map;
+    index_header_t check = *header;
+    check.header_crc = 0;
+    bool ok = memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) == 0 &&
+              header->version == INDEX_VERSION && header->header_crc == crc32c(0, &check, sizeof(check)) &&
+              header->file_size == (uint64_t)st.st_size &&
+              memcmp(&header->boot, &m->boot, sizeof(bpb_t)) == 0 &&
+              header->cluster_limit == data_cluster_limit(m) &&
+              header->group_count == (header->cluster_limit + INDEX_GROUP_CLUSTERS - 1) / INDEX_GROUP_CLUSTERS &&
+              index_section_fits(header, header->group_offset, header->group_count, sizeof(uint32_t)) &&
+              index_section_fits(header, header->bitmap_offset, index_bitmap_words(header->cluster_limit), sizeof(uint64_t)) &&
+              index_section_fits(header, header->extent_offset, header->extent_count, sizeof(index_extent_t)) &&
+              index_section_fits(header, header->dir_offset, header->dir_count, sizeof(index_dir_t)) &&
+              index_section_fits(header, header->entry_offset, header->entry_count, sizeof(index_entry_t));
+    if (!ok) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    uint8_t *base = map;
+    ix->map = map;
+    ix->map_size = st.st_size;
+    ix->group_crc = (uint32_t *)(base + header->group_offset);
+    ix->group_count = header->group_count;
+    ix->bitmap = (uint64_t *)(base + header->bitmap_offset);
+    ix->cluster_limit = header->cluster_limit;
+    ix->free_count = header->free_count;
+    ix->extents = (index_extent_t *)(base + header->extent_offset);
+    ix->extent_count = header->extent_count;
+    ix->dirs = (index_dir_t *)(base + header->dir_offset);
+    ix->dir_count = header->dir_count;
+    ix->entries = (index_entry_t *)(base + header->entry_offset);
+    ix->entry_count = header->entry_count;
+    return true;
+}
+
+// Checksums of the FSInfo sector and of the first group of FAT entries,
+// read straight from the image so the FAT cache is left alone
+bool index_head_crcs(mount_t *m, uint32_t *fsinfo_crc, uint32_t *head_crc) {
+    uint32_t sector_size = m->geo.sector_size;
+    uint32_t n = m->fat_cache_entries < INDEX_GROUP_CLUSTERS ? m->fat_cache_entries : INDEX_GROUP_CLUSTERS;
+    uint8_t *buffer = malloc(sector_size > n * sizeof(uint32_t) ? sector_size : n * sizeof(uint32_t));
+    if (buffer == NULL)
+        return false;
+    bool has_fsinfo = m->boot.BPB_FSInfo != 0 && m->boot.BPB_FSInfo < m->boot.BPB_RsvdSecCnt;
+    bool ok = !has_fsinfo || img_read(m, buffer, sector_size, (off_t)m->boot.BPB_FSInfo * sector_size);
+    if (ok)
+        *fsinfo_crc = has_fsinfo ? crc32c(0, buffer, sector_size) : 0;
+    ok = ok && img_read(m, buffer, (size_t)n * sizeof(uint32_t), m->geo.fat_offset);
+    if (ok)
+        *head_crc = crc32c(0, buffer, (size_t)n * sizeof(uint32_t));
+    free(buffer);
+    return ok;
+}
+
+// The generation stamp: size, mtime and the FSInfo and FAT head checksums
+bool index_stamp_matches(mount_t *m, const mount_index_t *ix, const struct stat *st) {
+    const index_header_t *header = ix->map;
+    uint32_t fsinfo_crc, head_crc;
+    return header->image_size == (uint64_t)st->st_size && header->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+           header->mtime_nsec == (int64_t)st->st_mtim.tv_nsec && index_head_crcs(m, &fsinfo_crc, &head_crc) &&
+           header->fsinfo_crc == fsinfo_crc && header->head_crc == head_crc;
+}
+
+const index_dir_t *index_lookup_dir(const mount_index_t *ix, uint32_t first_cluster) {
+    uint32_t low = 0, high = ix->dir_count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (ix->dirs[mid].first_cluster < first_cluster)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low < ix->dir_count && ix->dirs[low].first_cluster == first_cluster ? &ix->dirs[low] : NULL;
+}
+
+// A directory's indexed entries, or NULL unless the index is current and
+// holds the directory
+const index_dir_t *index_current_dir(mount_t *m, uint32_t dir_cluster) {
+    if (m->index == NULL || !m->index->dirs_current)
+        return NULL;
+    return index_lookup_dir(m->index, dir_cluster);
+}
+
+// Looks a name up in an indexed directory. Returns 1 if found, 0 if not,
+// and -1 if the directory is not in the index.
+int index_find_entry(mount_t *m, uint32_t dir_cluster, const char *name, dentry_t *found, uint32_t *entry_pos) {
+    const index_dir_t *dir = index_lookup_dir(m->index, dir_cluster);
+    if (dir == NULL)
+        return -1;
+    for (uint32_t i = 0; i < dir->entry_count; i++) {
+        const index_entry_t *item = &m->index->entries[dir->first_entry + i];
+        if (!is_live_entry(&item->entry))
+            continue;
+        char formatted_name[12];
+        format_dirname(item->entry.DIR_Name, formatted_name);
+        if (strcasecmp(formatted_name, name) == 0) {
+            *found = item->entry;
+            *entry_pos = item->pos;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Appends count items to a growable array. Returns false if out of memory.
+bool index_append(void **array, uint32_t *count, uint32_t *capacity, const void *items, uint32_t n, size_t size) {
+    if (*count + n > *capacity) {
+        uint32_t grown_capacity = *capacity ? *capacity : 256;
+        while (grown_capacity < *count + n)
+            grown_capacity *= 2;
+        void *grown = realloc(*array, (size_t)grown_capacity * size);
+        if (grown == NULL)
+            return false;
+        *array = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy((uint8_t *)*array + (size_t)*count * size, items, (size_t)n * size);
+    *count += n;
+    return true;
+}
+
+int compare_index_dirs(const void *a, const void *b) {
+    uint32_t x = ((const index_dir_t *)a)->first_cluster, y = ((const index_dir_t *)b)->first_cluster;
+    return x < y ? -1 : x > y;
+}
+
+static inline bool index_group_dirty(const mount_index_t *ix, uint32_t group) {
+    return ix->dirty_groups[group >> 6] >> (group & 63) & 1;
+}
+
+// True if this session changed neither a directory's clusters nor the FAT
+// entries that chain them, so its indexed entries still hold
+bool index_dir_clean(const mount_index_t *ix, uint32_t cluster) {
+    for (uint32_t steps = 0; steps < ix->cluster_limit; steps++) {
+        if (!is_chain_cluster(cluster))
+            return true;
+        if (cluster >= ix->cluster_limit || index_group_dirty(ix, cluster / INDEX_GROUP_CLUSTERS) ||
+            (ix->dirty_clusters[cluster >> 6] >> (cluster & 63) & 1))
+            return false;
+        cluster = index_fat_get(ix, cluster);
+    }
+    return false; // A loop
+}
+
+// Rebuilds the index from the image; the FAT must be loaded. Groups of FAT
+// entries and directories whose checksums match old are copied from it
+// instead of being decoded again; when old tracks what changed since it was
+// built, the rest are copied without being read at all. On success old's
+// arrays are replaced and its tracking starts over.
+bool index_build(mount_t *m, mount_index_t *old, bool reuse) {
+    mount_index_t ix;
+    memset(&ix, 0, sizeof(ix));
+    ix.cluster_limit = data_cluster_limit(m);
+    ix.group_count = (ix.cluster_limit + INDEX_GROUP_CLUSTERS - 1) / INDEX_GROUP_CLUSTERS;
+    ix.group_crc = malloc((ix.group_count ? ix.group_count : 1) * sizeof(uint32_t));
+    ix.bitmap = calloc(index_bitmap_words(ix.cluster_limit) + 1, sizeof(uint64_t));
+    uint64_t *visited = calloc(index_bitmap_words(ix.cluster_limit) + 1, sizeof(uint64_t));
+    uint32_t *group = malloc(INDEX_GROUP_CLUSTERS * sizeof(uint32_t));
+    uint32_t extent_capacity = 0, dir_capacity = 0, entry_capacity = 0;
+    uint32_t *queue = NULL, queue_count = 0, queue_capacity = 0;
+    bool ok = ix.group_crc != NULL && ix.bitmap != NULL && visited != NULL && group != NULL;
+    reuse = reuse && old->group_crc != NULL && old->cluster_limit == ix.cluster_limit;
+    bool tracked = reuse && old->dirty_groups != NULL && old->dirty_clusters != NULL;
+
+    // FAT: bitmap and extents, one group at a time
+    for (uint32_t g = 0; ok && g < ix.group_count; g++) {
+        uint32_t first = g * INDEX_GROUP_CLUSTERS;
+        uint32_t n = ix.cluster_limit - first < INDEX_GROUP_CLUSTERS ? ix.cluster_limit - first : INDEX_GROUP_CLUSTERS;
+        bool clean = tracked && !index_group_dirty(old, g);
+        if (clean) {
+            ix.group_crc[g] = old->group_crc[g];
+        } else {
+            if (!(ok = fat_read_entries(m, first, n, group)))
+                break;
+            ix.group_crc[g] = crc32c(0, group, (size_t)n * sizeof(uint32_t));
+        }
+
+        if (clean || (reuse && old->group_crc[g] == ix.group_crc[g])) {
+            memcpy(&ix.bitmap[first / 64], &old->bitmap[first / 64], (size_t)((n + 63) / 64) * sizeof(uint64_t));
+            uint32_t low = 0, high = old->extent_count;
+            while (low < high) {
+                uint32_t mid = low + (high - low) / 2;
+                if (old->extents[mid].start < first)
+                    low = mid + 1;
+                else
+                    high = mid;
+            }
+            uint32_t end = low;
+            while (end < old->extent_count && old->extents[end].start < first + n)
+                end++;
+            ok = index_append((void **)&ix.extents, &ix.extent_count, &extent_capacity, &old->extents[low],
+                              end - low, sizeof(index_extent_t));
+            continue;
+        }
+
+        index_extent_t run = { 0, 0, 0 };
+        for (uint32_t c = first; ok && c < first + n; c++) {
+            uint32_t value = group[c - first] & FAT_ENTRY_MASK;
+            if (value != 0)
+                ix.bitmap[c >> 6] |= (uint64_t)1 << (c & 63);
+            if (run.length > 0 && (value == 0 || run.next != c)) {
+                ok = index_append((void **)&ix.extents, &ix.extent_count, &extent_capacity, &run, 1, sizeof(run));
+                run.length = 0;
+            }
+            if (value != 0) {
+                if (run.length == 0)
+                    run.start = c;
+                run.length++;
+                run.next = value;
+            }
+        }
+        if (ok && run.length > 0)
+            ok = index_append((void **)&ix.extents, &ix.extent_count, &extent_capacity, &run, 1, sizeof(run));
+    }
+    uint32_t used = 0;
+    for (uint32_t w = 0; ok && w < index_bitmap_words(ix.cluster_limit); w++)
+        used += (uint32_t)__builtin_popcountll(ix.bitmap[w]);
+    for (uint32_t c = 0; c < 2 && c < ix.cluster_limit; c++)
+        used -= index_in_use(&ix, c);
+    ix.free_count = ix.cluster_limit > 2 ? ix.cluster_limit - 2 - used : 0;
+
+    // Directories, breadth first from the root
+    uint32_t root = m->boot.BPB_RootClus;
+    if (ok)
+        ok = index_append((void **)&queue, &queue_count, &queue_capacity, &root, 1, sizeof(uint32_t));
+    if (ok && root < ix.cluster_limit)
+        visited[root >> 6] |= (uint64_t)1 << (root & 63);
+    for (uint32_t q = 0; ok && q < queue_count; q++) {
+        const index_dir_t *previous = reuse && old->dirs != NULL ? index_lookup_dir(old, queue[q]) : NULL;
+        index_dir_t dir = { queue[q], 0, ix.entry_count, 0 };
+        uint8_t *buffer = NULL;
+        uint32_t size = 0;
+        if (previous != NULL && tracked && index_dir_clean(old, queue[q])) {
+            dir.crc = previous->crc;
+        } else {
+            if ((buffer = read_directory_chain(m, queue[q], &size)) == NULL)
+                continue;
+            dir.crc = crc32c(0, buffer, size);
+        }
+        if (previous != NULL && previous->crc == dir.crc) {
+            ok = index_append((void **)&ix.entries, &ix.entry_count, &entry_capacity,
+                              &old->entries[previous->first_entry], previous->entry_count, sizeof(index_entry_t));
+        } else {
+            for (uint32_t i = 0; ok && i < size; i += sizeof(dentry_t)) {
+                index_entry_t item;
+                memcpy(&item.entry, buffer + i, sizeof(dentry_t));
+                if (item.entry.DIR_Name[0] == 0x00) // No more entries
+                    break;
+                if ((unsigned char)item.entry.DIR_Name[0] == 0xE5) // Deleted
+                    continue;
+                item.pos = i;
+                ok = index_append((void **)&ix.entries, &ix.entry_count, &entry_capacity, &item, 1, sizeof(item));
+            }
+        }
+        free(buffer);
+        dir.entry_count = ix.entry_count - dir.first_entry;
+        if (ok)
+            ok = index_append((void **)&ix.dirs, &ix.dir_count, &dir_capacity, &dir, 1, sizeof(dir));
+
+        for (uint32_t i = dir.first_entry; ok && i < ix.entry_count; i++) {
+            const dentry_t *entry = &ix.entries[i].entry;
+            uint32_t child = entry_first_cluster(entry);
+            if (!is_live_entry(entry) || !(entry->DIR_Attr & 0x10) || is_dot_entry(entry) || !is_chain_cluster(child) ||
+                child >= ix.cluster_limit || (visited[child >> 6] >> (child & 63) & 1))
+                continue;
+            visited[child >> 6] |= (uint64_t)1 << (child & 63);
+            ok = index_append((void **)&queue, &queue_count, &queue_capacity, &child, 1, sizeof(uint32_t));
+        }
+    }
+    if (ok && ix.dir_count > 0)
+        qsort(ix.dirs, ix.dir_count, sizeof(index_dir_t), compare_index_dirs);
+    free(queue);
+    free(visited);
+    free(group);
+
+    if (!ok) {
+        perror("Error building index");
+        index_release(&ix);
+        return false;
+    }
+    index_release(old);
+    old->group_crc = ix.group_crc;
+    old->group_count = ix.group_count;
+    old->bitmap = ix.bitmap;
+    old->cluster_limit = ix.cluster_limit;
+    old->free_count = ix.free_count;
+    old->extents = ix.extents;
+    old->extent_count = ix.extent_count;
+    old->dirs = ix.dirs;
+    old->dir_count = ix.dir_count;
+    old->entries = ix.entries;
+    old->entry_count = ix.entry_count;
+    if (old->dirty_groups != NULL)
+        memset(old->dirty_groups, 0, index_bitmap_words(old->group_count) * sizeof(uint64_t));
+    if (old->dirty_clusters != NULL)
+        memset(old->dirty_clusters, 0, index_bitmap_words(old->cluster_limit) * sizeof(uint64_t));
+    return true;
+}
+
+bool index_write_section(FILE *file, const void *data, size_t size, uint64_t *offset) {
+    static const uint8_t zeros[8];
+    size_t pad = (8 - size % 8) % 8;
+    *offset += size + pad;
+    return (size == 0 || fwrite(data, 1, size, file) == size) && fwrite(zeros, 1, pad, file) == pad;
+}
+
+// Writes the index next to the image, stamped with the image's current
+// size, mtime, FSInfo and FAT head. The file is replaced atomically.
+bool index_save(mount_t *m, mount_index_t *ix) {
+    struct stat st;
+    uint32_t fsinfo_crc, head_crc;
+    if (fstat(m->img_fd, &st) != 0 || !index_head_crcs(m, &fsinfo_crc, &head_crc))
+        return false;
+
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.image_size = st.st_size;
+    header.mtime_sec = st.st_mtim.tv_sec;
+    header.mtime_nsec = st.st_mtim.tv_nsec;
+    header.boot = m->boot;
+    header.cluster_limit = ix->cluster_limit;
+    header.free_count = ix->free_count;
+    header.fsinfo_crc = fsinfo_crc;
+    header.head_crc = head_crc;
+    header.group_count = ix->group_count;
+    header.extent_count = ix->extent_count;
+    header.dir_count = ix->dir_count;
+    header.entry_count = ix->entry_count;
+
+    size_t sizes[5] = { ix->group_count * sizeof(uint32_t), index_bitmap_words(ix->cluster_limit) * sizeof(uint64_t),
+                        ix->extent_count * sizeof(index_extent_t), ix->dir_count * sizeof(index_dir_t),
+                        ix->entry_count * sizeof(index_entry_t) };
+    uint64_t *offsets[5] = { &header.group_offset, &header.bitmap_offset, &header.extent_offset,
+                             &header.dir_offset, &header.entry_offset };
+    uint64_t offset = sizeof(header);
+    for (int i = 0; i < 5; i++) {
+        *offsets[i] = offset;
+        offset += (sizes[i] + 7) / 8 * 8;
+    }
+    header.file_size = offset;
+    header.header_crc = crc32c(0, &header, sizeof(header));
+
+    char temp_path[1100];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", ix->path);
+    FILE *file = fopen(temp_path, "wb");
+    if (file == NULL)
+        return false;
+    const void *sections[5] = { ix->group_crc, ix->bitmap, ix->extents, ix->dirs, ix->entries };
+    uint64_t written = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < 5; i++)
+        ok = index_write_section(file, sections[i], sizes[i], &written);
+    ok = fclose(file) == 0 && ok;
+    if (ok)
+        ok = rename(temp_path, ix->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Warning: could not save index '%s'.\n", ix->path);
+        unlink(temp_path);
+    }
+    return ok;
+}
+
+// True if every group of FAT entries on the image still has the checksum
+// the index was built from. This reads the whole FAT, so it only runs with
+// --verify-index: the stamp misses a change past the FAT head made by a
+// tool that leaves FSInfo alone and sets the mtime back.
+bool index_groups_match(mount_t *m, const mount_index_t *ix) {
+    if (ix->cluster_limit != data_cluster_limit(m))
+        return false;
+    uint32_t *group = malloc(INDEX_GROUP_CLUSTERS * sizeof(uint32_t));
+    if (group == NULL)
+        return false;
+    bool match = true;
+    for (uint32_t g = 0; match && g < ix->group_count; g++) {
+        uint32_t first = g * INDEX_GROUP_CLUSTERS;
+        uint32_t n = ix->cluster_limit - first < INDEX_GROUP_CLUSTERS ? ix->cluster_limit - first : INDEX_GROUP_CLUSTERS;
+        match = fat_read_entries(m, first, n, group) &&
+                crc32c(0, group, (size_t)n * sizeof(uint32_t)) == ix->group_crc[g];
+    }
+    free(group);
+    return match;
+}
+
+// Starts recording what the session changes. Without it the unmount
+// rebuild reads the whole FAT and every directory.
+void index_track(mount_index_t *ix) {
+    ix->dirty_groups = calloc(index_bitmap_words(ix->group_count) + 1, sizeof(uint64_t));
+    ix->dirty_clusters = calloc(index_bitmap_words(ix->cluster_limit) + 1, sizeof(uint64_t));
+    if (ix->dirty_groups == NULL || ix->dirty_clusters == NULL) {
+        free(ix->dirty_groups);
+        free(ix->dirty_clusters);
+        ix->dirty_groups = NULL;
+        ix->dirty_clusters = NULL;
+    }
+}
+
+// Called from mount_fat32 with --index. Uses the sidecar index if its stamp
+// is current, so chains and free space need no FAT lookups; otherwise
+// rebuilds and saves it. The mount carries on without an index if that
+// fails.
+void index_open(mount_t *m, const char *image_path) {
+    mount_index_t *ix = calloc(1, sizeof(mount_index_t));
+    if (ix == NULL)
+        return;
+    const char *slash = strrchr(image_path, '/');
+    int dir_length = slash != NULL ? (int)(slash - image_path + 1) : 0;
+    snprintf(ix->path, sizeof(ix->path), "%.*s.%s.idx", dir_length, image_path, image_path + dir_length);
+
+    struct stat st;
+    bool mapped = index_map(m, ix);
+    if (mapped && fstat(m->img_fd, &st) == 0 && index_stamp_matches(m, ix, &st) &&
+        (!m->options.verify_index || index_groups_match(m, ix))) {
+        index_track(ix);
+        ix->dirs_current = true;
+        m->index = ix;
+        return;
+    }
+
+    if (!index_build(m, ix, mapped)) {
+        index_release(ix);
+        free(ix);
+        return;
+    }
+    index_save(m, ix);
+    index_track(ix);
+    ix->dirs_current = true;
+    m->index = ix;
+}
+
+// A writer command is about to run: stop answering lookups from the index
+void index_note_write(mount_t *m) {
+    if (m->index == NULL)
+        return;
+    m->index->dirs_current = false;
+    m->index->changed = true;
+}
+
+// Brings the index up to date with any changes and releases it
+void index_close(mount_t *m) {
+    mount_index_t *ix = m->index;
+    if (ix == NULL)
+        return;
+    if (ix->changed && index_build(m, ix, true))
+        index_save(m, ix);
+    index_release(ix);
+    free(ix->dirty_groups);
+    free(ix->dirty_clusters);
+    free(ix);
+    m->index = NULL;
+}
+
+// ============================================================================
+// ============================================================================
+
+// Part 16: Directory compaction
+
+// Deleting only marks an entry 0xE5, so lookups in a directory with a lot
+// of churn mostly step over dead entries. Compaction packs the remaining
+// entries to the front of the chain, "." and ".." first, zeroes the rest
+// so the end-of-directory marker follows the last entry, and frees
+// clusters that are left empty. The directory keeps its first cluster, so
+// the ".." entries of its subdirectories stay valid. rm, rmdir and rm -r
+// compact the directory they removed from once deleted entries reach
+// COMPACT_MIN_DELETED and outnumber the live ones.
+#define COMPACT_MIN_DELETED 32
+
+typedef struct {
+    uint32_t deleted;  // Entries removed
+    uint32_t freed;    // Clusters released
+    uint32_t clusters; // Chain length afterwards
+} compact_result_t;
+
+// Compacts the directory starting at dir_cluster. With only_if_sparse,
+// does nothing unless the threshold above is reached.
+bool compact_directory(mount_t *m, uint32_t dir_cluster, bool only_if_sparse, compact_result_t *result) {
+    uint32_t cluster_size = m->geo.cluster_size;
+    memset(result, 0, sizeof(*result));
+    uint32_t count;
+    uint32_t *chain = get_cluster_chain(m, dir_cluster, &count);
+    if (chain == NULL)
+        return false;
+    result->clusters = count;
+
+    uint32_t size = count * cluster_size;
+    uint32_t slots = size / sizeof(dentry_t);
+    uint8_t *buffer = malloc(size);
+    uint32_t *new_pos = malloc(slots * sizeof(uint32_t));
+    if (buffer == NULL || new_pos == NULL) {
+        perror("Memory allocation failed");
+        free(buffer);
+        free(new_pos);
+        free(chain);
+        return false;
+    }
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; i++)
+        ok = img_read(m, buffer + (size_t)i * cluster_size, cluster_size, calculate_cluster_offset(m, chain[i]));
+
+    uint32_t kept = 0, deleted = 0, end = slots;
+    for (uint32_t i = 0; ok && i < slots; i++) {
+        const dentry_t *entry = (const dentry_t *)buffer + i;
+        if (entry->DIR_Name[0] == 0x00) { // No more entries
+            end = i;
+            break;
+        }
+        if ((unsigned char)entry->DIR_Name[0] == 0xE5)
+            deleted++;
+        else
+            kept++;
+    }
+    uint32_t keep_clusters = (kept * sizeof(dentry_t) + cluster_size - 1) / cluster_size;
+    if (keep_clusters == 0)
+        keep_clusters = 1;
+    bool worth = only_if_sparse ? deleted >= COMPACT_MIN_DELETED && deleted > kept
+                                : deleted > 0 || keep_clusters < count;
+    if (!ok || !worth) {
+        free(buffer);
+        free(new_pos);
+        free(chain);
+        return ok;
+    }
+
+    // Pack: dot entries first, then everything else that is not deleted
+    // (long-name fragments stay in front of their entries)
+    uint8_t *packed = calloc(keep_clusters, cluster_size);
+    if (packed == NULL) {
+        perror("Memory allocation failed");
+        free(buffer);
+        free(new_pos);
+        free(chain);
+        return false;
+    }
+    uint32_t next = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < end; i++) {
+            const dentry_t *entry = (const dentry_t *)buffer + i;
+            if ((unsigned char)entry->DIR_Name[0] == 0xE5)
+                continue;
+            bool dot = (entry->DIR_Attr & 0x0F) != 0x0F && is_dot_entry(entry);
+            if (dot != (pass == 0))
+                continue;
+            memcpy(packed + (size_t)next * sizeof(dentry_t), entry, sizeof(dentry_t));
+            new_pos[i] = next++ * sizeof(dentry_t);
+        }
+    }
+
+    // Entries first, then release the clusters they no longer need
+    for (uint32_t i = 0; ok && i < keep_clusters; i++)
+        ok = img_write(m, packed + (size_t)i * cluster_size, cluster_size, calculate_cluster_offset(m, chain[i]));
+    if (ok && keep_clusters < count) {
+        fat_set(m, chain[keep_clusters - 1], FAT_EOC);
+        reclaim_chain(m, chain[keep_clusters]);
+        result->freed = count - keep_clusters;
+        result->clusters = keep_clusters;
+    }
+    if (ok) {
+        result->deleted = deleted;
+        // Open handles remember where their entries are
+        pthread_mutex_lock(&m->open_files_lock);
+        for (int i = 0; i < m->open_files_count; i++) {
+            uint32_t slot = m->open_files[i].entry_pos / sizeof(dentry_t);
+            if (m->open_files[i].dir_cluster == dir_cluster && slot < end)
+                m->open_files[i].entry_pos = new_pos[slot];
+        }
+        pthread_mutex_unlock(&m->open_files_lock);
+    }
+    free(packed);
+    free(buffer);
+    free(new_pos);
+    free(chain);
+    return ok;
+}
+
+// Automatic compaction after a removal
+void compact_directory_if_sparse(mount_t *m, uint32_t dir_cluster) {
+    compact_result_t result;
+    compact_directory(m, dir_cluster, true, &result);
+}
+
+void compact_command(mount_t *m, char *args) {
+    char path[1024] = ".";
+    sscanf(args, "%1023s", path);
+
+    dentry_t entry;
+    uint32_t parent_cluster, entry_pos;
+    if (!resolve_path(m, path, &entry, &parent_cluster, &entry_pos)) {
+        command_error(m, "Error: Directory '%s' not found.\n", path);
+        return;
+    }
+    if (!(entry.DIR_Attr & 0x10)) {
+        command_error(m, "Error: '%s' is not a directory.\n", path);
+        return;
+    }
+    compact_result_t result;
+    if (!compact_directory(m, entry_first_cluster(&entry), false, &result)) {
+        command_error(m, "Error: could not compact '%s'.\n", path);
+        return;
+    }
+    fprintf(m->out, "Compacted '%s': %u deleted entr%s removed, %u cluster(s) freed, %u cluster(s) in use.\n",
+            path, result.deleted, result.deleted == 1 ? "y" : "ies", result.freed, result.clusters);
+}
+
+// ============================================================================
+// ============================================================================
+
+// Main Functions
+
+// Prints why a command failed and marks it failed, which run_command()
+// reports. Safe from the sum and grep workers.
+void command_error(mount_t *m, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(m->out, format, args);
+    va_end(args);
+    __atomic_store_n(&m->command_failed, true, __ATOMIC_RELAXED);
+}
+
+// True for commands that modify the image and so need fs_lock exclusively
+bool is_writer_command(const char *command) {
+    const char *writers[] = { "mkdir ", "creat ", "write ", "rm ", "rmdir ", "defrag", "cp ", "truncate ", "sync",
+                              "compactdir" };
+    for (size_t i = 0; i < sizeof(writers) / sizeof(writers[0]); i++) {
+        if (strncmp(command, writers[i], strlen(writers[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+typedef enum { COMMAND_OK, COMMAND_FAILED, COMMAND_EXIT } command_status_t;
+
+// Runs one command against the mount. Returns COMMAND_EXIT for "exit",
+// which the caller handles, since what exiting means depends on the
+// session.
+command_status_t run_command(mount_t *m, char *command) {
+    if (strcmp(command, "exit") == 0)
+        return COMMAND_EXIT;
+    m->command_failed = false;
+
+    // Buffered writes reach the image before any other command runs
+    pthread_mutex_lock(&m->open_files_lock);
+    bool flush = strncmp(command, "write ", 6) != 0 && writes_pending(m);
+    pthread_mutex_unlock(&m->open_files_lock);
+
+    bool writer = is_writer_command(command);
+    if (flush || writer) {
+        pthread_rwlock_wrlock(&m->fs_lock);
+        index_note_write(m);
+    } else
+        pthread_rwlock_rdlock(&m->fs_lock);
+    if (flush)
+        flush_all_writes(m);
+    if (flush && !writer) {
+        // Only the flush needed the write lock; readers such as ls, read
+        // and sum still run shared. The reclaimer may slip in between,
+        // which it could as well before the command.
+        pthread_rwlock_unlock(&m->fs_lock);
+        pthread_rwlock_rdlock(&m->fs_lock);
+    }
+
+    if (strcmp(command, "info") == 0)
+        getInfo(m);
+    else if (strncmp(command, "cd ", 3) == 0)
+        change_directory(m, command + 3); // Skip "cd "
+    else if (strcmp(command, "ls") == 0)
+        list_directory(m);
+    else if (strncmp(command, "mkdir ", 6) == 0)
+        create_directory(m, command + 6); // Skip "mkdir "
+    else if (strncmp(command, "creat ", 6) == 0)
+        create_file(m, command + 6); // Skip "creat "
+    else if(strncmp(command, "open ", 5) == 0)
+        open_file(m, command + 5);
+    else if(strncmp(command, "close ", 6) == 0)
+        close_file(m, command + 6);
+    else if(strncmp(command, "lsof", 5) == 0)
+        list_all(m);
+    else if(strncmp(command, "lseek ", 6) == 0)
+        set_file_offset(m, command + 6);
+    else if(strncmp(command, "read ", 5) == 0)
+        read_file(m, command + 5);
+    else if(strncmp(command, "write ", 6) == 0)
+        write_file(m, command + 6);
+    else if(strcmp(command, "sync") == 0)
+        ; // Flushed above
+
+    else if(strncmp(command, "rm -r ", 6) == 0)
+        remove_recursive(m, command + 6);
+    else if(strncmp(command, "rm ", 3) == 0)
+        remove_file(m, command + 3);
+    else if(strncmp(command, "rmdir ", 6) == 0)
+        remove_directory(m, command + 6);
+    else if(strncmp(command, "truncate ", 9) == 0)
+        truncate_file(m, command + 9);
+    else if(strncmp(command, "cp -r ", 6) == 0)
+        copy_path(m, command + 6, true);
+    else if(strncmp(command, "cp ", 3) == 0)
+        copy_path(m, command + 3, false);
+    else if(strncmp(command, "sum ", 4) == 0)
+        sum_command(m, command + 4);
+    else if(strncmp(command, "grep ", 5) == 0)
+        grep_command(m, command + 5);
+    else if(strcmp(command, "dupes") == 0 || strncmp(command, "dupes ", 6) == 0)
+        dupes_command(m, command + 5);
+    else if(strcmp(command, "compactdir") == 0 || strncmp(command, "compactdir ", 11) == 0)
+        compact_command(m, command + 10);
+    else if(strcmp(command, "defrag") == 0 || strncmp(command, "defrag ", 7) == 0)
+        defrag(m, command + 6);
+    else
+        command_error(m, "Invalid command.\n");
+
+    pthread_rwlock_unlock(&m->fs_lock);
+    return m->command_failed ? COMMAND_FAILED : COMMAND_OK;
+}
+
+// Workload record and replay.
+// --record writes every command main_process() reads to a trace file with
+// its start time and latency (microseconds since the session started) and
+// the CRC32C of what it printed ("-" if that could not be captured):
+//     <start_us> TAB <latency_us> TAB <output_crc> TAB <command>
+// --replay runs a trace against a scratch copy of the image, paced like the
+// original (or --speed N times faster, or --max for back-to-back), prints
+// exactly what an interactive run prints, reports every command whose
+// output differs from the recording and the latency distribution on
+// stderr. v1 traces, which have no output checksums, still replay.
+#define TRACE_HEADER "# filesys trace v2"
+#define TRACE_HEADER_V1 "# filesys trace v1"
+
+uint64_t elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - since->tv_sec) * 1000000 + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+bool start_recording(mount_t *m, const char *trace_path) {
+    m->record_file = fopen(trace_path, "w");
+    if (m->record_file == NULL) {
+        perror("Error opening trace");
+        return false;
+    }
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+    fprintf(m->record_file, "%s\n# image %s\n# started %s\n", TRACE_HEADER, m->img_path, stamp);
+    fflush(m->record_file);
+    return true;
+}
+
+void record_command(mount_t *m, uint64_t start_us, uint64_t latency_us, bool captured, uint32_t output_crc,
+                    const char *command) {
+    char crc_text[16] = "-";
+    if (captured)
+        snprintf(crc_text, sizeof(crc_text), "%08x", output_crc);
+    fprintf(m->record_file, "%" PRIu64 "\t%" PRIu64 "\t%s\t%s\n", start_us, latency_us, crc_text, command);
+    fflush(m->record_file); // Keep the trace usable if the session dies
+}
+
+// Runs a command with its output captured, then passes the output on to
+// m->out. Returns false in *captured, with the command run uncaptured, if
+// the output cannot be buffered; otherwise its CRC32C is in *output_crc.
+command_status_t run_command_captured(mount_t *m, char *command, bool *captured, uint32_t *output_crc) {
+    char *output = NULL;
+    size_t size = 0;
+    FILE *capture = open_memstream(&output, &size);
+    *captured = capture != NULL;
+    if (capture == NULL)
+        return run_command(m, command);
+
+    FILE *out = m->out;
+    m->out = capture;
+    command_status_t status = run_command(m, command);
+    m->out = out;
+    fclose(capture);
+    fwrite(output, 1, size, out);
+    *output_crc = crc32c(0, output, size);
+    free(output);
+    return status;
+}
+
+typedef struct {
+    uint64_t start_us;
+    uint64_t recorded_us;
+    uint64_t replayed_us;
+    bool has_crc;          // The recording holds an output checksum
+    uint32_t output_crc;
+    char command[256];
+} trace_entry_t;
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile of a sorted array
+uint64_t percentile(const uint64_t *sorted, size_t count, int pct) {
+    if (count == 0)
+        return 0;
+    size_t rank = (count * pct + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Prints one row of the latency table for the entries whose command starts
+// with name (all entries if name is NULL)
+void replay_report_row(const trace_entry_t *entries, size_t count, const char *name, const char *label) {
+    uint64_t *replayed = malloc((count ? count : 1) * sizeof(uint64_t));
+    uint64_t *recorded = malloc((count ? count : 1) * sizeof(uint64_t));
+    if (replayed == NULL || recorded == NULL) {
+        free(replayed);
+        free(recorded);
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = name ? strlen(name) : 0;
+        if (name != NULL && (strncmp(entries[i].command, name, len) != 0 ||
+                             (entries[i].command[len] != ' ' && entries[i].command[len] != '\0')))
+            continue;
+        replayed[n] = entries[i].replayed_us;
+        recorded[n] = entries[i].recorded_us;
+        n++;
+    }
+    qsort(replayed, n, sizeof(uint64_t), compare_u64);
+    qsort(recorded, n, sizeof(uint64_t), compare_u64);
+    fprintf(stderr, "%-10s %7zu %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+            label, n, percentile(replayed, n, 50), percentile(replayed, n, 90), percentile(replayed, n, 99),
+            n ? replayed[n - 1] : 0, percentile(recorded, n, 50), percentile(recorded, n, 99));
+    free(replayed);
+    free(recorded);
+}
+
+void replay_report(const trace_entry_t *entries, size_t count, uint64_t wall_us) {
+    fprintf(stderr, "Replayed %zu command(s) in %.3f s (%.1f commands/s)\n", count, wall_us / 1e6,
+            wall_us > 0 ? count * 1e6 / wall_us : 0.0);
+    fprintf(stderr, "%-10s %7s %9s %9s %9s %9s %12s %12s\n", "command", "count", "p50 us", "p90 us",
+            "p99 us", "max us", "rec p50 us", "rec p99 us");
+
+    // One row per command word, in order of first appearance
+    char seen[64][16];
+    int seen_count = 0;
+    for (size_t i = 0; i < count && seen_count < 64; i++) {
+        char word[16];
+        sscanf(entries[i].command, "%15s", word);
+        bool known = false;
+        for (int k = 0; k < seen_count && !known; k++)
+            known = strcmp(seen[k], word) == 0;
+        if (!known) {
+            strcpy(seen[seen_count++], word);
+            replay_report_row(entries, count, word, word);
+        }
+    }
+    replay_report_row(entries, count, NULL, "all");
+}
+
+// Copies the image to a scratch file, skipping holes so sparse images
+// stay sparse. Returns the path of the copy in copy_path.
+bool copy_image_for_replay(const char *image, char *copy_path, size_t copy_path_size) {
+    snprintf(copy_path, copy_path_size, "%s.replay-XXXXXX", image);
+    int out = mkstemp(copy_path);
+    int in = open(image, O_RDONLY);
+    struct stat st;
+    if (out < 0 || in < 0 || fstat(in, &st) != 0 || ftruncate(out, st.st_size) != 0) {
+        perror("Error copying image for replay");
+        if (out >= 0) {
+            close(out);
+            unlink(copy_path);
+        }
+        if (in >= 0)
+            close(in);
+        return false;
+    }
+
+    bool ok = true;
+    off_t pos = 0;
+    while (ok && pos < st.st_size) {
+        off_t data = lseek(in, pos, SEEK_DATA);
+        if (data < 0)
+            break; // Only a hole is left
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0)
+            hole = st.st_size;
+        loff_t from = data, to = data;
+        size_t length = hole - data;
+        while (ok && length > 0) {
+            ssize_t n = copy_file_range(in, &from, out, &to, length, 0);
+            if (n <= 0) {
+                // Fall back to read/write for what is left of this extent
+                uint8_t buffer[64 * 1024];
+                ssize_t got = pread(in, buffer, length < sizeof(buffer) ? length : sizeof(buffer), from);
+                ok = got > 0 && pwrite(out, buffer, got, to) == got;
+                n = got;
+                from += n;
+                to += n;
+            }
+            length -= n;
+        }
+        pos = hole;
+    }
+    close(in);
+    close(out);
+    if (!ok) {
+        printf("Error: could not copy '%s' for replay.\n", image);
+        unlink(copy_path);
+    }
+    return ok;
+}
+
+// Runs a recorded trace against the mounted image. speed scales the
+// original pacing; 0 means run commands back-to-back.
+void replay_trace(mount_t *m, const char *trace_path, double speed) {
+    FILE *trace = fopen(trace_path, "r");
+    if (trace == NULL) {
+        perror("Error opening trace");
+        return;
+    }
+
+    size_t count = 0, capacity = 0;
+    trace_entry_t *entries = NULL;
+    char line[512];
+    bool with_crcs = true; // v2; a v1 header turns this off
+    while (fgets(line, sizeof(line), trace) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        if (strcmp(line, TRACE_HEADER_V1) == 0)
+            with_crcs = false;
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            trace_entry_t *grown = realloc(entries, capacity * sizeof(trace_entry_t));
+            if (grown == NULL) {
+                perror("Memory allocation failed");
+                break;
+            }
+            entries = grown;
+        }
+        trace_entry_t *entry = &entries[count];
+        char *tab1 = strchr(line, '\t');
+        char *tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
+        char *tab3 = tab2 && with_crcs ? strchr(tab2 + 1, '\t') : NULL;
+        if (tab2 == NULL || (with_crcs && tab3 == NULL))
+            continue; // Not a trace line
+        entry->start_us = strtoull(line, NULL, 10);
+        entry->recorded_us = strtoull(tab1 + 1, NULL, 10);
+        entry->has_crc = with_crcs && tab2[1] != '-';
+        entry->output_crc = entry->has_crc ? (uint32_t)strtoul(tab2 + 1, NULL, 16) : 0;
+        snprintf(entry->command, sizeof(entry->command), "%s", with_crcs ? tab3 + 1 : tab2 + 1);
+        count++;
+    }
+    fclose(trace);
+
+    struct timespec replay_start;
+    clock_gettime(CLOCK_MONOTONIC, &replay_start);
+    bool exited = false;
+    size_t ran = 0, compared = 0, mismatched = 0;
+    for (; ran < count && !exited; ran++) {
+        if (speed > 0) {
+            // Wait for the command's (scaled) place in the original timeline
+            uint64_t due = (uint64_t)(entries[ran].start_us / speed);
+            uint64_t now = elapsed_us(&replay_start);
+            if (due > now) {
+                struct timespec pause = { (time_t)((due - now) / 1000000), (long)((due - now) % 1000000) * 1000 };
+                nanosleep(&pause, NULL);
+            }
+        }
+        display_prompt(m);
+        uint64_t started = elapsed_us(&replay_start);
+        bool captured;
+        uint32_t output_crc;
+        exited = run_command_captured(m, entries[ran].command, &captured, &output_crc) == COMMAND_EXIT;
+        entries[ran].replayed_us = elapsed_us(&replay_start) - started;
+        if (captured && entries[ran].has_crc) {
+            compared++;
+            if (output_crc != entries[ran].output_crc) {
+                mismatched++;
+                fprintf(stderr, "Output differs from the recording: command %zu, '%s'\n", ran + 1,
+                        entries[ran].command);
+            }
+        }
+    }
+    if (!exited) {
+        display_prompt(m); // What an interactive session prints at end of input
+        fprintf(m->out, "\n");
+    }
+    uint64_t wall_us = elapsed_us(&replay_start);
+    fflush(stdout);
+
+    reclaim_drain(m); // Background frees are part of the workload
+    replay_report(entries, ran, wall_us);
+    if (compared > 0)
+        fprintf(stderr, "Output: %zu of %zu command(s) differ from the recording\n", mismatched, compared);
+    free(entries);
+}
+
+void main_process(mount_t *m) {
+    char command[256];
+    clock_gettime(CLOCK_MONOTONIC, &m->session_start);
+    while (1) {
+        display_prompt(m);
+        if (fgets(command, 256, stdin) == NULL) {
+            fprintf(m->out, "\n");
+            exitProgram(m); // End of input
+        }
+
+        // remove trailing newline
+        command[strcspn(command, "\n")] = 0;
+
+        uint64_t started = elapsed_us(&m->session_start);
+        command_status_t status;
+        if (m->record_file != NULL) {
+            bool captured;
+            uint32_t output_crc = 0;
+            status = run_command_captured(m, command, &captured, &output_crc);
+            record_command(m, started, elapsed_us(&m->session_start) - started, captured, output_crc, command);
+        } else {
+            status = run_command(m, command);
+        }
+        if (status == COMMAND_EXIT)
+            exitProgram(m);
+    }
+}
+
+void print_usage() {
+    printf("Usage: filesys <FAT32 ISO> [--readahead KB] [--fat-cache MB] [--index [--verify-index]] [--defrag [-d] [path]]\n");
+    printf("       filesys <FAT32 ISO> [--record <trace>]\n");
+    printf("       filesys <FAT32 ISO> --replay <trace> [--speed N | --max]\n");
+    printf("       filesys --mkfs <path> <size> [--cluster N] [--label L]\n");
+    printf("       filesys --each <dir-of-images> -b <script> [-j threads] [--fat-cache MB] [--index [--verify-index]]\n");
+}
+
+// Batch runs over a directory of images.
+// --each mounts every image in a directory in its own context and runs the
+// same script against each one on a thread pool sized to the cores. Each
+// image's output is collected in memory and printed as one block, in name
+// order, as soon as the images before it are done; a summary follows.
+typedef struct {
+    char path[1024];
+    const char *name;
+    char **script;
+    int script_lines;
+    char *output;          // Everything the image's commands printed
+    size_t output_size;
+    bool mounted;
+    int commands;
+    int errors;            // Commands that failed
+    uint64_t elapsed_us;
+    bool done;
+} each_job_t;
+
+typedef struct {
+    each_job_t *jobs;
+    int count;
+    int next_to_print;
+    pthread_mutex_t lock;
+    mount_options_t options; // Given to every image's mount
+} each_run_t;
+
+each_run_t each_run = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, MOUNT_OPTIONS_DEFAULT };
+
+void each_image_job(void *arg) {
+    each_job_t *job = arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    mount_t *m = malloc(sizeof(mount_t));
+    FILE *out = open_memstream(&job->output, &job->output_size);
+    if (m != NULL && out != NULL) {
+        mount_init(m, &each_run.options);
+        m->out = out;
+        job->mounted = mount_fat32(m, job->path);
+        if (job->mounted) {
+            snprintf(m->img_path, sizeof(m->img_path), "%s", job->name);
+            for (int i = 0; i < job->script_lines; i++) {
+                char command[256];
+                snprintf(command, sizeof(command), "%s", job->script[i]);
+                display_prompt(m);
+                fprintf(out, "%s\n", command); // Echo, as a terminal would
+                job->commands++;
+                command_status_t status = run_command(m, command);
+                if (status == COMMAND_EXIT)
+                    break;
+                if (status == COMMAND_FAILED)
+                    job->errors++;
+            }
+            unmount_fat32(m);
+        } else {
+            mount_destroy(m);
+        }
+        fclose(out);
+    } else {
+        perror("Error starting batch job");
+        if (out != NULL)
+            fclose(out);
+    }
+    free(m);
+    job->elapsed_us = elapsed_us(&start);
+
+    // Print finished images in order
+    pthread_mutex_lock(&each_run.lock);
+    job->done = true;
+    while (each_run.next_to_print < each_run.count && each_run.jobs[each_run.next_to_print].done) {
+        each_job_t *ready = &each_run.jobs[each_run.next_to_print++];
+        printf("==> %s <==\n", ready->name);
+        if (ready->output != NULL)
+            fwrite(ready->output, 1, ready->output_size, stdout);
+        printf("\n");
+        free(ready->output);
+        ready->output = NULL;
+    }
+    pthread_mutex_unlock(&each_run.lock);
+}
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Reads the non-empty, non-comment lines of a script. Caller frees.
+char **read_script(const char *path, int *count) {
+    FILE *file = fopen(path, "r");
+    *count = 0;
+    if (file == NULL)
+        return NULL;
+    char **lines = NULL;
+    int capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            char **grown = realloc(lines, capacity * sizeof(char *));
+            if (grown == NULL)
+                break;
+            lines = grown;
+        }
+        lines[(*count)++] = strdup(line);
+    }
+    fclose(file);
+    return lines;
+}
+
+int each_main(int argc, char const *argv[]) {
+    const char *dir_path = argc > 2 ? argv[2] : NULL;
+    const char *script_path = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    mount_options_t options = MOUNT_OPTIONS_DEFAULT;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+            script_path = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--readahead") == 0 && i + 1 < argc)
+            options.readahead_max = (uint32_t)strtoul(argv[++i], NULL, 10) * 1024;
+        else if (strcmp(argv[i], "--index") == 0)
+            options.use_index = true;
+        else if (strcmp(argv[i], "--verify-index") == 0)
+            options.verify_index = true;
+        else if (strcmp(argv[i], "--fat-cache") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            options.fat_cache_max = (uint64_t)atoi(argv[++i]) * 1024 * 1024;
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (dir_path == NULL || script_path == NULL) {
+        print_usage();
+        return 1;
+    }
+
+    int script_lines;
+    char **script = read_script(script_path, &script_lines);
+    if (script == NULL && script_lines == 0) {
+        printf("Error: could not read script '%s'.\n", script_path);
+        return 1;
+    }
+
+    // Every regular, non-hidden file in the directory is taken as an image
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        printf("Error: could not open directory '%s'.\n", dir_path);
+        return 1;
+    }
+    char **names = NULL;
+    int name_count = 0, name_capacity = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        char path[1024];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir_path, de->d_name);
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (name_count == name_capacity) {
+            name_capacity = name_capacity ? name_capacity * 2 : 64;
+            char **grown = realloc(names, name_capacity * sizeof(char *));
+            if (grown == NULL)
+                break;
+            names = grown;
+        }
+        names[name_count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    if (name_count > 0)
+        qsort(names, name_count, sizeof(char *), compare_strings);
+
+    each_run.jobs = calloc(name_count ? name_count : 1, sizeof(each_job_t));
+    each_run.count = name_count;
+    if (each_run.jobs == NULL) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    for (int i = 0; i < name_count; i++) {
+        each_job_t *job = &each_run.jobs[i];
+        snprintf(job->path, sizeof(job->path), "%s/%s", dir_path, names[i]);
+        job->name = names[i];
+        job->script = script;
+        job->script_lines = script_lines;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    thread_pool_t pool;
+    if (threads > name_count)
+        threads = name_count;
+    pool_init(&pool, threads > 0 ? (int)threads : 0);
+    // Split the cores between the images so sum and grep inside each image
+    // do not multiply the thread count
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    options.parallel_threads = threads > 0 && cores / threads > 1 ? cores / threads : 1;
+    each_run.options = options;
+    for (int i = 0; i < name_count; i++)
+        pool_submit(&pool, each_image_job, &each_run.jobs[i]);
+    pool_wait(&pool);
+    pool_destroy(&pool);
+    uint64_t wall_us = elapsed_us(&start);
+
+    // Aggregate
+    int mounted = 0, failed = 0, with_errors = 0, total_errors = 0, total_commands = 0;
+    uint64_t busy_us = 0, slowest_us = 0;
+    const char *slowest = "";
+    for (int i = 0; i < name_count; i++) {
+        each_job_t *job = &each_run.jobs[i];
+        busy_us += job->elapsed_us;
+        if (!job->mounted) {
+            failed++;
+            continue;
+        }
+        mounted++;
+        total_commands += job->commands;
+        total_errors += job->errors;
+        with_errors += job->errors > 0;
+        if (job->elapsed_us > slowest_us) {
+            slowest_us = job->elapsed_us;
+            slowest = job->name;
+        }
+    }
+    printf("Summary: %d image(s), %d mounted, %d failed to mount, %d with errors\n",
+           name_count, mounted, failed, with_errors);
+    printf("         %d command(s), %d error(s), %ld thread(s), %.3f s wall, %.3f s total\n",
+           total_commands, total_errors, threads, wall_us / 1e6, busy_us / 1e6);
+    if (mounted > 0)
+        printf("         slowest: %s (%.3f s)\n", slowest, slowest_us / 1e6);
+    for (int i = 0; i < name_count; i++) {
+        each_job_t *job = &each_run.jobs[i];
+        if (!job->mounted)
+            printf("  %-40s not mounted\n", job->name);
+        else if (job->errors > 0)
+            printf("  %-40s %d error(s)\n", job->name, job->errors);
+    }
+
+    for (int i = 0; i < name_count; i++)
+        free(names[i]);
+    free(names);
+    for (int i = 0; i < script_lines; i++)
+        free(script[i]);
+    free(script);
+    free(each_run.jobs);
+    return failed > 0 || with_errors > 0 ? 2 : 0;
+}
+
+int main(int argc, char const *argv[])
+{
+    if (argc < 2) {
+        print_usage();
+        return 1;
+    }
+    if (strcmp(argv[1], "--mkfs") == 0)
+        return mkfs_main(argc, argv);
+    if (strcmp(argv[1], "--each") == 0)
+        return each_main(argc, argv);
+
+    mount_options_t options = MOUNT_OPTIONS_DEFAULT;
+    int defrag_arg = 0;
+    const char *record_path = NULL, *replay_path = NULL;
+    double replay_speed = 1.0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--readahead") == 0 && i + 1 < argc) {
+            options.readahead_max = (uint32_t)strtoul(argv[++i], NULL, 10) * 1024;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            options.use_index = true;
+        } else if (strcmp(argv[i], "--verify-index") == 0) {
+            options.verify_index = true;
+        } else if (strcmp(argv[i], "--fat-cache") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            options.fat_cache_max = (uint64_t)atoi(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            replay_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--max") == 0) {
+            replay_speed = 0;
+        } else if (strcmp(argv[i], "--defrag") == 0) {
+            defrag_arg = i; // Everything after this belongs to defrag
+            break;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    // Replays run against a scratch copy so the image itself is untouched
+    char replay_copy[1024];
+    if (replay_path != NULL)
+        options.use_index = false; // No point indexing a scratch copy
+    if (replay_path != NULL && !copy_image_for_replay(argv[1], replay_copy, sizeof(replay_copy)))
+        return 1;
+
+    // Open and mount FAT32 File
+    static mount_t mount;
+    mount_init(&mount, &options);
+    if (!mount_fat32(&mount, replay_path != NULL ? replay_copy : argv[1])) {
+        mount_destroy(&mount);
+        if (replay_path != NULL)
+            unlink(replay_copy);
+        return 1;
+    }
+
+    if (replay_path != NULL) {
+        snprintf(mount.img_path, 50, "%s", argv[1]); // Prompt matches the recorded run
+        replay_trace(&mount, replay_path, replay_speed);
+        unlink(replay_copy);
+        exitProgram(&mount);
+    }
+    if (record_path != NULL && !start_recording(&mount, record_path))
+        return 1;
+
+    if (defrag_arg > 0) {
+        // Batch mode: defragment and exit
+        char args[1024] = "";
+        for (int i = defrag_arg + 1; i < argc; i++) {
+            strncat(args, " ", sizeof(args) - strlen(args) - 1);
+            strncat(args, argv[i], sizeof(args) - strlen(args) - 1);
+        }
+        pthread_rwlock_wrlock(&mount.fs_lock);
+        index_note_write(&mount);
+        defrag(&mount, args);
+        pthread_rwlock_unlock(&mount.fs_lock);
+        exitProgram(&mount);
     }
-    mount_fat32(argv[1]);
 
     // Run main process
-    main_process();
+    main_process(&mount);
 
     return 0;
 }